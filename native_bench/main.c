@@ -0,0 +1,73 @@
+#include "../src/bench/bench.h"
+
+#if defined(__GLIBC__)
+    #include <errno.h>
+    #include <stddef.h>
+
+/*
+ * Every allocation of the process goes through these, GLib's and the benchmark's alike. They count and forward to
+ * glibc's allocator.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static guint64 allocation_count = 0;
+
+static void count_allocation(void) {
+    __atomic_fetch_add(&allocation_count, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    count_allocation();
+    void *memory = __libc_memalign(alignment, size);
+    if (!memory) return ENOMEM;
+
+    *ptr = memory;
+    return 0;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+static guint64 get_allocation_count(void) {
+    return __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+#if defined(__GLIBC__)
+    return create_bench(argc, argv, get_allocation_count);
+#else
+    return create_bench(argc, argv, NULL);
+#endif
+}
@@ -0,0 +1,5 @@
+#include "../src/replay/replay.h"
+
+int main(int argc, char *argv[]) {
+    return create_replay(argc, argv);
+}
@@ -1,16 +1,78 @@
+#ifdef __linux__
+    #include <glib-unix.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "../src/server/server.h"
 #include "../src/utils/logger.h"
+#include "../src/utils/shm_ring.h"
+
+static gchar* capture_path = NULL;
+static gchar* shm_socket_path = NULL;
+
+static GOptionEntry options[] = {{
+                                     "capture",
+                                     'c',
+                                     0,
+                                     G_OPTION_ARG_FILENAME,
+                                     &capture_path,
+                                     "Record all websocket frames to a trace file",
+                                     "FILE",
+                                 },
+                                 {
+                                     "shm-socket",
+                                     's',
+                                     0,
+                                     G_OPTION_ARG_FILENAME,
+                                     &shm_socket_path,
+                                     "Accept shared memory rings from local clients on this Unix socket (e.g. "
+                                     SHM_SOCKET_PATH_DEFAULT ")",
+                                     "PATH",
+                                 },
+                                 {NULL}};
+
+// Main loop breaker, so that the capture trace gets flushed on Ctrl+C
+static gboolean sigint_handler(gpointer user_data) {
+    g_main_loop_quit(user_data);
+    return G_SOURCE_REMOVE;
+}
 
 int main(int argc, char* argv[]) {
+    GError* error = NULL;
+
+    GOptionContext* option_context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(option_context, options, NULL);
+
+    if (!g_option_context_parse(option_context, &argc, &argv, &error)) {
+        g_print("Option context parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(option_context);
+
     Server* server = server_new();
 
+    if (capture_path && !server_start_capture(server, capture_path, &error)) {
+        g_print("Failed to start capture: %s\n", error->message);
+        exit(1);
+    }
+
+    if (shm_socket_path && !server_enable_shm_transport(server, shm_socket_path, &error)) {
+        g_print("Failed to enable shared memory transport: %s\n", error->message);
+        exit(1);
+    }
+
     ALOGD("Starting main loop");
 
     GMainLoop* main_loop = g_main_loop_new(NULL, FALSE);
+#ifdef __linux__
+    g_unix_signal_add(SIGINT, sigint_handler, main_loop);
+#endif
     g_main_loop_run(main_loop);
 
     ALOGD("Exited main loop, cleaning up");
     g_main_loop_unref(main_loop);
+    g_object_unref(server);
+    g_clear_pointer(&capture_path, g_free);
+    g_clear_pointer(&shm_socket_path, g_free);
 }
@@ -0,0 +1,217 @@
+#include "bench.h"
+
+#include <json-glib/json-glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../server/control_message.h"
+#include "../server/processor.h"
+#include "../utils/arena.h"
+#include "../utils/buffer_pool.h"
+
+/// Messages run before measuring, so that pools, arenas and parsers have warmed up
+#define BENCH_WARMUP_MESSAGES 1000
+
+/// Frames in flight in the processor scenario, below its backpressure watermark
+#define BENCH_PROCESSOR_BATCH 8
+
+static gint message_count = 100000;
+/// One 20 ms tick of 48 kHz stereo S16
+static gint frame_size = 3840;
+
+static GOptionEntry options[] = {{
+                                     "messages",
+                                     'n',
+                                     0,
+                                     G_OPTION_ARG_INT,
+                                     &message_count,
+                                     "Messages measured per scenario",
+                                     "N",
+                                 },
+                                 {
+                                     "frame-size",
+                                     's',
+                                     0,
+                                     G_OPTION_ARG_INT,
+                                     &frame_size,
+                                     "Binary frame size in bytes",
+                                     "BYTES",
+                                 },
+                                 {NULL}};
+
+static const gchar ping_message[] = "{\"msg\":\"ping\",\"seq\":12345,\"time\":987654321}";
+
+typedef struct {
+    BenchAllocationCounter allocation_counter;
+    guint8 *frame;
+
+    GBytes *ping;
+    JsonParser *parser;
+    Arena *arena;
+
+    Processor *processor;
+    guint64 processed;
+} BenchState;
+
+typedef void (*BenchFunc)(BenchState *state);
+
+/*
+ *
+ * Scenarios, one message per call.
+ *
+ */
+
+static void bench_frame_copy(BenchState *state) {
+    GBytes *bytes = g_bytes_new(state->frame, frame_size);
+    g_bytes_unref(bytes);
+}
+
+static void bench_frame_pooled(BenchState *state) {
+    GBytes *bytes = buffer_pool_new_bytes(state->frame, frame_size);
+    g_bytes_unref(bytes);
+}
+
+/// The server's ping handling with a parser per message, as before parsers were kept per connection.
+static void bench_control_fresh(BenchState *state) {
+    JsonParser *parser = json_parser_new();
+
+    JsonObject *ping = control_message_parse(parser, state->ping, NULL);
+    control_message_format_pong(state->arena, ping);
+
+    arena_reset(state->arena);
+    g_object_unref(parser);
+}
+
+/// The server's ping handling as it runs per message.
+static void bench_control_reused(BenchState *state) {
+    JsonObject *ping = control_message_parse(state->parser, state->ping, NULL);
+    control_message_format_pong(state->arena, ping);
+
+    arena_reset(state->arena);
+}
+
+static gpointer bench_process_frame(gpointer stream_id, GBytes *data, gint64 timestamp_us, gpointer user_data) {
+    gsize size = 0;
+    const gint16 *samples = g_bytes_get_data(data, &size);
+
+    gint32 peak = 0;
+    for (gsize i = 0; i < size / sizeof(gint16); i++) {
+        peak = MAX(peak, ABS((gint32)samples[i]));
+    }
+
+    return GINT_TO_POINTER(peak + 1);
+}
+
+static void bench_frame_processed(gpointer stream_id, gpointer result, gpointer user_data) {
+    BenchState *state = user_data;
+    state->processed++;
+}
+
+/// Frames go through the processor pool and back to the main context, as binary messages do in the server.
+static void bench_processor(BenchState *state) {
+    static guint64 pushed = 0;
+
+    GBytes *bytes = buffer_pool_new_bytes(state->frame, frame_size);
+    processor_push(state->processor, state, bytes);
+    g_bytes_unref(bytes);
+    pushed++;
+
+    while (pushed - state->processed >= BENCH_PROCESSOR_BATCH) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+/*
+ *
+ * Driver.
+ *
+ */
+
+static void bench_run(BenchState *state, const gchar *name, BenchFunc func) {
+    for (gint i = 0; i < BENCH_WARMUP_MESSAGES; i++) {
+        func(state);
+    }
+
+    BufferPoolStats pool_before;
+    buffer_pool_get_stats(&pool_before);
+    guint64 allocations_before = state->allocation_counter ? state->allocation_counter() : 0;
+    gint64 start_us = g_get_monotonic_time();
+
+    for (gint i = 0; i < message_count; i++) {
+        func(state);
+    }
+
+    gint64 elapsed_us = g_get_monotonic_time() - start_us;
+    guint64 allocations = state->allocation_counter ? state->allocation_counter() - allocations_before : 0;
+    BufferPoolStats pool_after;
+    buffer_pool_get_stats(&pool_after);
+
+    gdouble messages = (gdouble)message_count;
+    gchar *allocations_str = state->allocation_counter ? g_strdup_printf("%.2f", (gdouble)allocations / messages)
+                                                       : g_strdup("n/a");
+
+    g_print("%-24s %12s %14.2f %14.2f %10.0f\n",
+            name,
+            allocations_str,
+            (gdouble)(pool_after.requests - pool_before.requests) / messages,
+            (gdouble)(pool_after.misses - pool_before.misses) / messages,
+            (gdouble)elapsed_us * 1000 / messages);
+
+    g_free(allocations_str);
+}
+
+int create_bench(int argc, char *argv[], BenchAllocationCounter allocation_counter) {
+    GError *error = NULL;
+
+    GOptionContext *option_context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(option_context, options, NULL);
+
+    if (!g_option_context_parse(option_context, &argc, &argv, &error)) {
+        g_print("Option context parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(option_context);
+
+    if (message_count <= 0 || frame_size <= 0) {
+        g_print("Message count and frame size must be positive\n");
+        exit(1);
+    }
+
+    BenchState state = {0};
+    state.allocation_counter = allocation_counter;
+    state.frame = g_malloc(frame_size);
+    for (gint i = 0; i < frame_size; i++) {
+        state.frame[i] = (guint8)g_random_int();
+    }
+    state.ping = g_bytes_new_static(ping_message, sizeof(ping_message) - 1);
+    state.parser = json_parser_new();
+    state.arena = arena_new(4096);
+
+    ProcessorFuncs processor_funcs = {
+        .work = bench_process_frame,
+        .done = bench_frame_processed,
+    };
+    state.processor = processor_new(NULL, 0, &processor_funcs, &state);
+
+    g_print("%d messages per scenario, %d byte frames\n\n", message_count, frame_size);
+    g_print("%-24s %12s %14s %14s %10s\n", "Scenario", "allocs/msg", "pooled/msg", "pool miss/msg", "ns/msg");
+
+    bench_run(&state, "frame copy", bench_frame_copy);
+    bench_run(&state, "frame pooled", bench_frame_pooled);
+    bench_run(&state, "control parser per msg", bench_control_fresh);
+    bench_run(&state, "control server path", bench_control_reused);
+    bench_run(&state, "processor round trip", bench_processor);
+
+    if (!allocation_counter) {
+        g_print("\nAllocation counting is not supported on this platform\n");
+    }
+
+    processor_free(state.processor);
+    arena_free(state.arena);
+    g_object_unref(state.parser);
+    g_bytes_unref(state.ping);
+    g_free(state.frame);
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Allocations made by the process so far, counted by the executable. NULL if the platform can't count them.
+typedef guint64 (*BenchAllocationCounter)(void);
+
+/// Measure steady-state allocations and time per message on the receive path, with and without buffer reuse.
+int create_bench(int argc, char *argv[], BenchAllocationCounter allocation_counter);
+
+#ifdef __cplusplus
+}
+#endif
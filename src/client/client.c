@@ -5,15 +5,29 @@
 #include <libsoup/soup-message.h>
 #include <libsoup/soup-session.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "../utils/audio_loader.h"
 #include "../utils/logger.h"
+#include "../utils/shm_ring.h"
+#include "../utils/trace.h"
+#include "rate_control.h"
 #include "stdio.h"
 
 static gchar *websocket_uri = NULL;
+static gchar *capture_path = NULL;
+static gchar *room = NULL;
+static gdouble gain = 1.0;
+static gboolean listen_to_room = FALSE;
+static gchar *shm_socket_path = NULL;
 
 #define WEBSOCKET_URI_DEFAULT "ws://10.11.24.141:8000/a2f"
 
+/// Probes still unanswered beyond this are forgotten, e.g. with a server that doesn't answer pings
+#define PROBE_OUTSTANDING_MAX 32
+
+#define RATE_LOG_INTERVAL_US (5 * G_USEC_PER_SEC)
+
 static GOptionEntry options[] = {{
                                      "websocket-uri",
                                      'u',
@@ -23,24 +37,109 @@ static GOptionEntry options[] = {{
                                      "Websocket URI",
                                      "URI",
                                  },
+                                 {
+                                     "capture",
+                                     'c',
+                                     0,
+                                     G_OPTION_ARG_FILENAME,
+                                     &capture_path,
+                                     "Record all websocket frames to a trace file",
+                                     "FILE",
+                                 },
+                                 {
+                                     "room",
+                                     'r',
+                                     0,
+                                     G_OPTION_ARG_STRING,
+                                     &room,
+                                     "Server room to mix the audio into",
+                                     "NAME",
+                                 },
+                                 {
+                                     "gain",
+                                     'g',
+                                     0,
+                                     G_OPTION_ARG_DOUBLE,
+                                     &gain,
+                                     "Linear gain applied to the audio by the server mixer",
+                                     "GAIN",
+                                 },
+                                 {
+                                     "listen",
+                                     'l',
+                                     0,
+                                     G_OPTION_ARG_NONE,
+                                     &listen_to_room,
+                                     "Receive the room's mix, including this client's own audio",
+                                     NULL,
+                                 },
+                                 {
+                                     "shm-socket",
+                                     's',
+                                     0,
+                                     G_OPTION_ARG_FILENAME,
+                                     &shm_socket_path,
+                                     "Send PCM through shared memory to a server on this host (e.g. "
+                                     SHM_SOCKET_PATH_DEFAULT ")",
+                                     "PATH",
+                                 },
                                  {NULL}};
 
 struct MyState {
     SoupWebsocketConnection *connection;
     guint timeout_id;
 
-    char *audio_buffer;
+    /// Mapped WAV data, chunks are sent as slices of it
+    GBytes *audio_buffer;
     guint8 channels;
     gint32 sampleRate;
     guint8 bitsPerSample;
     int audio_buffer_size;
 
-    int current_chunk_idx;
-    int chunk_duration;
+    /// Bytes of the audio buffer sent so far, playback time runs from stream_start_us
+    gsize sent_bytes;
+    gint64 stream_start_us;
+    guint64 sent_chunks;
+    gboolean eos_sent;
+
+    /// Chunk size and in-flight limit, adapted to the measured RTT
+    RateControl rate;
+
+    guint probe_id;
+    gint64 next_probe_seq;
+    /// ClientProbe, in send order
+    GQueue probes;
+    /// Everything sent before the latest answered probe has reached the server
+    gsize acked_bytes;
+
+    gint64 last_rate_log_us;
+
+    /// The server asked to hold off sending PCM until it has caught up
+    gboolean paused;
+
+    /// Reused for every message, so that control messages don't set up JSON machinery each time
+    JsonParser *json_parser;
+    JsonBuilder *json_builder;
+    GString *text_buffer;
+
+    TraceWriter *trace_writer;
+
+    /// Carries the PCM instead of the websocket when the server is on the same host
+    ShmRing *shm_ring;
+    gchar *shm_token;
+    /// Tags ring frames, the server holds a frame back until it has handled the websocket messages sent before it
+    guint32 websocket_messages_sent;
 };
 
 struct MyState ws_state = {};
 
+/// A ping in flight. The server answers pings in order with the binary frames, so its pong acknowledges every byte
+/// sent before it.
+typedef struct {
+    gint64 seq;
+    gsize sent_bytes;
+} ClientProbe;
+
 /*
  *
  * Websocket connection.
@@ -53,22 +152,169 @@ static gboolean sigint_handler(gpointer user_data) {
     return G_SOURCE_REMOVE;
 }
 
-static void handle_json_message(GBytes *message) {
+static void client_send_text(SoupWebsocketConnection *connection, const gchar *text) {
+    trace_writer_record(ws_state.trace_writer, 0, TRACE_DIRECTION_OUT, TRACE_FRAME_TEXT, text, strlen(text));
+
+    soup_websocket_connection_send_text(connection, text);
+    ws_state.websocket_messages_sent++;
+}
+
+/// Returns FALSE if the shared memory ring is full, the frame should be sent again later.
+static gboolean client_send_binary(SoupWebsocketConnection *connection, GBytes *bytes) {
+    gsize size = 0;
+    gconstpointer data = g_bytes_get_data(bytes, &size);
+
+    // Frames too large for the ring take the websocket, the sequence orders ring frames against websocket messages
+    if (ws_state.shm_ring && size <= shm_ring_get_max_message_size(ws_state.shm_ring)) {
+        if (!shm_ring_write(ws_state.shm_ring, ws_state.websocket_messages_sent, data, size)) {
+            return FALSE;
+        }
+    } else {
+        soup_websocket_connection_send_message(connection, SOUP_WEBSOCKET_DATA_BINARY, bytes);
+        ws_state.websocket_messages_sent++;
+    }
+
+    trace_writer_record_bytes(ws_state.trace_writer, 0, TRACE_DIRECTION_OUT, TRACE_FRAME_BINARY, bytes);
+
+    return TRUE;
+}
+
+/*
+ *
+ * Rate adaptation.
+ *
+ */
+
+static gsize client_unacked_bytes(void) {
+    return ws_state.sent_bytes - ws_state.acked_bytes;
+}
+
+static void client_log_rate(const gchar *reason) {
+    ALOGI("PCM rate %s: chunk %u ms, in-flight limit %zu bytes, unacked %zu bytes, RTT %.1f ms (min %.1f ms), "
+          "%" G_GUINT64_FORMAT " chunks sent",
+          reason,
+          ws_state.rate.chunk_ms,
+          ws_state.rate.inflight_limit,
+          client_unacked_bytes(),
+          (gdouble)ws_state.rate.srtt_us / 1000,
+          ws_state.rate.srtt_us > 0 ? (gdouble)ws_state.rate.rtt_min_us / 1000 : 0.0,
+          ws_state.sent_chunks);
+
+    ws_state.last_rate_log_us = g_get_monotonic_time();
+}
+
+static void client_adapt_rate(gint64 now_us) {
+    guint previous_ms = rate_control_adapt(&ws_state.rate, ws_state.paused, client_unacked_bytes(), now_us);
+
+    guint chunk_ms = ws_state.rate.chunk_ms;
+    const gchar *reason = chunk_ms > previous_ms ? "up" : chunk_ms < previous_ms ? "down" : NULL;
+
+    if (reason) {
+        client_log_rate(reason);
+    } else if (now_us - ws_state.last_rate_log_us >= RATE_LOG_INTERVAL_US) {
+        client_log_rate("steady");
+    }
+}
+
+static void client_reset_rate(void) {
+    gsize frame_size = (gsize)(ws_state.bitsPerSample / 8) * ws_state.channels;
+    rate_control_reset(&ws_state.rate, ws_state.sampleRate, frame_size, g_get_monotonic_time());
+
+    ws_state.acked_bytes = 0;
+    g_queue_clear_full(&ws_state.probes, g_free);
+}
+
+static gboolean client_send_probe(SoupWebsocketConnection *connection) {
+    if (soup_websocket_connection_get_state(connection) != SOUP_WEBSOCKET_STATE_OPEN) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (g_queue_get_length(&ws_state.probes) >= PROBE_OUTSTANDING_MAX) {
+        g_free(g_queue_pop_head(&ws_state.probes));
+    }
+
+    ClientProbe *probe = g_new0(ClientProbe, 1);
+    probe->seq = ws_state.next_probe_seq++;
+    probe->sent_bytes = ws_state.sent_bytes;
+    g_queue_push_tail(&ws_state.probes, probe);
+
+    g_string_printf(ws_state.text_buffer,
+                    "{\"msg\":\"ping\",\"seq\":%" G_GINT64_FORMAT ",\"time\":%" G_GINT64_FORMAT "}",
+                    probe->seq,
+                    g_get_monotonic_time());
+    client_send_text(connection, ws_state.text_buffer->str);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void client_handle_pong(JsonObject *msg) {
+    if (!json_object_has_member(msg, "seq") || !json_object_has_member(msg, "time")) {
+        return;
+    }
+
+    gint64 seq = json_object_get_int_member(msg, "seq");
+    gint64 now_us = g_get_monotonic_time();
+    gint64 rtt_us = now_us - json_object_get_int_member(msg, "time");
+
+    // Pongs arrive in order, probes before this one went unanswered
+    ClientProbe *probe;
+    while ((probe = g_queue_peek_head(&ws_state.probes)) && probe->seq <= seq) {
+        g_queue_pop_head(&ws_state.probes);
+
+        if (probe->seq == seq) {
+            ws_state.acked_bytes = MAX(ws_state.acked_bytes, probe->sent_bytes);
+        }
+        g_free(probe);
+    }
+
+    if (rtt_us < 0) return;
+
+    rate_control_update_rtt(&ws_state.rate, rtt_us, now_us);
+    client_adapt_rate(now_us);
+}
+
+/// Returns NULL unless the member exists and holds a string, the server may be anything that accepted the connection.
+static const gchar *json_object_get_string_or_null(JsonObject *object, const gchar *member) {
+    JsonNode *node = json_object_get_member(object, member);
+
+    if (!node || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_STRING) {
+        return NULL;
+    }
+
+    return json_node_get_string(node);
+}
+
+/// Returns TRUE if the message was a JSON control message.
+static gboolean handle_json_message(GBytes *message) {
     gsize length = 0;
     const gchar *msg_data = g_bytes_get_data(message, &length);
 
-    JsonParser *parser = json_parser_new();
+    JsonParser *parser = ws_state.json_parser;
     GError *error = NULL;
+    gboolean handled = FALSE;
 
     if (json_parser_load_from_data(parser, msg_data, length, &error)) {
-        JsonObject *msg = json_node_get_object(json_parser_get_root(parser));
+        JsonNode *root = json_parser_get_root(parser);
+        if (!root || !JSON_NODE_HOLDS_OBJECT(root)) {
+            goto out;
+        }
+
+        JsonObject *msg = json_node_get_object(root);
 
-        if (!json_object_has_member(msg, "msg")) {
+        const gchar *msg_type = json_object_get_string_or_null(msg, "msg");
+        if (!msg_type) {
             // Invalid message
             goto out;
         }
 
-        const gchar *msg_type = json_object_get_string_member(msg, "msg");
+        handled = TRUE;
+
+        // Several per second, the rate log covers them
+        if (g_str_equal(msg_type, "pong")) {
+            client_handle_pong(msg);
+            goto out;
+        }
+
         g_print("Websocket message received: %s\n", msg_type);
 
         if (g_str_equal(msg_type, "offer")) {
@@ -79,6 +325,8 @@ static void handle_json_message(GBytes *message) {
 
             // process_candidate(json_object_get_int_member(candidate, "sdpMLineIndex"),
             //                   json_object_get_string_member(candidate, "candidate"));
+        } else if (g_str_equal(msg_type, "backpressure")) {
+            ws_state.paused = json_object_get_boolean_member(msg, "paused");
         }
     } else {
         g_debug("Error parsing message: %s", error->message);
@@ -86,13 +334,25 @@ static void handle_json_message(GBytes *message) {
     }
 
 out:
-    g_object_unref(parser);
+    return handled;
 }
 
 void send_pcm_descriptor(gboolean is_eos) {
-    JsonBuilder *builder = json_builder_new();
+    JsonBuilder *builder = ws_state.json_builder;
+    json_builder_reset(builder);
     json_builder_begin_object(builder);
 
+    json_builder_set_member_name(builder, "msg");
+    json_builder_add_string_value(builder, "descriptor");
+
+    if (room) {
+        json_builder_set_member_name(builder, "room");
+        json_builder_add_string_value(builder, room);
+    }
+
+    json_builder_set_member_name(builder, "gain");
+    json_builder_add_double_value(builder, gain);
+
     json_builder_set_member_name(builder, "channels");
     json_builder_add_int_value(builder, ws_state.channels);
 
@@ -115,28 +375,55 @@ void send_pcm_descriptor(gboolean is_eos) {
     {
         gchar *msg_str = json_to_string(root, TRUE);
 
-        soup_websocket_connection_send_text(ws_state.connection, msg_str);
+        client_send_text(ws_state.connection, msg_str);
 
         g_free(msg_str);
     }
 
     json_node_unref(root);
-    g_object_unref(builder);
+}
+
+/// Senders only receive their room's mix if they ask for it.
+static void client_send_join(void) {
+    JsonBuilder *builder = ws_state.json_builder;
+    json_builder_reset(builder);
+    json_builder_begin_object(builder);
+
+    json_builder_set_member_name(builder, "msg");
+    json_builder_add_string_value(builder, "join");
+
+    if (room) {
+        json_builder_set_member_name(builder, "room");
+        json_builder_add_string_value(builder, room);
+    }
+
+    json_builder_end_object(builder);
+
+    JsonNode *root = json_builder_get_root(builder);
+    gchar *msg_str = json_to_string(root, FALSE);
+
+    client_send_text(ws_state.connection, msg_str);
+
+    g_free(msg_str);
+    json_node_unref(root);
 }
 
 static void websocket_message_cb(SoupWebsocketConnection *connection, gint type, GBytes *message, gpointer user_data) {
+    trace_writer_record_bytes(ws_state.trace_writer, 0, TRACE_DIRECTION_IN, type, message);
+
     switch (type) {
         case SOUP_WEBSOCKET_DATA_BINARY: {
             gsize data_size = g_bytes_get_size(message);
-            ALOGE("Received binary message, size: %lu", data_size);
+            ALOGD("Received binary message, size: %lu", data_size);
             break;
         }
         case SOUP_WEBSOCKET_DATA_TEXT: {
             gsize length = 0;
             const gchar *msg_str = g_bytes_get_data(message, &length);
-            ALOGE("Received text message: %s", msg_str);
 
-            // handle_json_message(message);
+            if (!handle_json_message(message)) {
+                ALOGE("Received text message: %.*s", (int)length, msg_str);
+            }
         } break;
         default:
             g_assert_not_reached();
@@ -151,6 +438,7 @@ static void websocket_closed_cb(SoupWebsocketConnection *connection, gint type,
     }
 
     g_clear_handle_id(&ws_state.timeout_id, g_source_remove);
+    g_clear_handle_id(&ws_state.probe_id, g_source_remove);
 
     ALOGD("Connection closed remotely");
 }
@@ -161,7 +449,7 @@ gboolean send_test_message(SoupWebsocketConnection *connection) {
     if (socket_state == SOUP_WEBSOCKET_STATE_OPEN) {
         // gchar *msg_str = json_to_string(msg, TRUE);
 
-        soup_websocket_connection_send_text(connection, "Hi! from client. Please send some binary data.");
+        client_send_text(connection, "Hi! from client. Please send some binary data.");
 
         // g_free(msg_str);
     } else {
@@ -171,40 +459,67 @@ gboolean send_test_message(SoupWebsocketConnection *connection) {
     return G_SOURCE_CONTINUE;
 }
 
-gboolean send_pcm(SoupWebsocketConnection *connection) {
-    SoupWebsocketState socket_state = soup_websocket_connection_get_state(connection);
+/// Sends the audio that is due by now in chunks of the current size, as far as the in-flight limit allows.
+static void client_send_due_pcm(SoupWebsocketConnection *connection) {
+    gsize total = (gsize)ws_state.audio_buffer_size;
 
-    if (socket_state == SOUP_WEBSOCKET_STATE_OPEN) {
-        int data_start = ws_state.current_chunk_idx * ws_state.chunk_duration * ws_state.sampleRate *
-                         (ws_state.bitsPerSample / 8) * ws_state.channels;
-        int data_end = (ws_state.current_chunk_idx + 1) * ws_state.chunk_duration * ws_state.sampleRate *
-                       (ws_state.bitsPerSample / 8) * ws_state.channels;
-
-        // EOS
-        gboolean eos = data_end >= ws_state.audio_buffer_size;
-        if (eos) {
-            data_end = ws_state.audio_buffer_size;
-        }
+    gint64 elapsed_ms = (g_get_monotonic_time() - ws_state.stream_start_us) / 1000;
+    gsize due = MIN(rate_control_ms_to_bytes(&ws_state.rate, elapsed_ms), total);
 
-        ALOGD("Send PCM chunk of %d second, size: %d",
-              ws_state.current_chunk_idx * ws_state.chunk_duration,
-              data_end - data_start);
-        soup_websocket_connection_send_binary(connection, ws_state.audio_buffer + data_start, data_end - data_start);
+    while (ws_state.sent_bytes < total) {
+        gsize chunk_size = rate_control_ms_to_bytes(&ws_state.rate, ws_state.rate.chunk_ms);
+        gsize size = MIN(chunk_size, total - ws_state.sent_bytes);
 
-        ws_state.current_chunk_idx++;
+        // Only whole chunks, except for the tail of the buffer
+        if (ws_state.sent_bytes + size > due) break;
 
-        if (eos) {
-            ALOGD("PCM reaches EOF");
-            send_pcm_descriptor(TRUE);
+        if (!rate_control_may_send(&ws_state.rate, client_unacked_bytes(), size)) break;
 
-            // Stop timer
-            g_clear_handle_id(&ws_state.timeout_id, g_source_remove);
+        GBytes *chunk = g_bytes_new_from_bytes(ws_state.audio_buffer, ws_state.sent_bytes, size);
+        gboolean sent = client_send_binary(connection, chunk);
+        g_bytes_unref(chunk);
+
+        if (!sent) {
+            ALOGW("Shared memory ring is full, retrying PCM chunk on the next tick");
+            break;
         }
-    } else {
+
+        ws_state.sent_bytes += size;
+        ws_state.sent_chunks++;
+    }
+
+    if (ws_state.sent_bytes >= total) {
+        ALOGD("PCM reaches EOF");
+        client_log_rate("at EOF");
+        send_pcm_descriptor(TRUE);
+
+        ws_state.eos_sent = TRUE;
+        g_clear_handle_id(&ws_state.probe_id, g_source_remove);
+    }
+}
+
+/// Runs once per chunk duration and re-arms itself, so that chunk size changes take effect on the next tick.
+gboolean send_pcm(SoupWebsocketConnection *connection) {
+    ws_state.timeout_id = 0;
+
+    SoupWebsocketState socket_state = soup_websocket_connection_get_state(connection);
+
+    if (socket_state != SOUP_WEBSOCKET_STATE_OPEN) {
         g_warning("Trying to send message using websocket that isn't open!");
+        return G_SOURCE_REMOVE;
     }
 
-    return G_SOURCE_CONTINUE;
+    if (ws_state.paused) {
+        ALOGD("Server is backpressuring, holding PCM");
+    } else {
+        client_send_due_pcm(connection);
+    }
+
+    if (!ws_state.eos_sent) {
+        ws_state.timeout_id = g_timeout_add(ws_state.rate.chunk_ms, G_SOURCE_FUNC(send_pcm), connection);
+    }
+
+    return G_SOURCE_REMOVE;
 }
 
 static void websocket_connected_cb(GObject *session, GAsyncResult *res, gpointer user_data) {
@@ -223,20 +538,39 @@ static void websocket_connected_cb(GObject *session, GAsyncResult *res, gpointer
         g_signal_connect(ws_state.connection, "message", G_CALLBACK(websocket_message_cb), NULL);
         g_signal_connect(ws_state.connection, "closed", G_CALLBACK(websocket_closed_cb), NULL);
 
-        ws_state.audio_buffer = load_wav_c("test_audio.wav",
-                                           &ws_state.channels,
-                                           &ws_state.sampleRate,
-                                           &ws_state.bitsPerSample,
-                                           &ws_state.audio_buffer_size);
+        ws_state.websocket_messages_sent = 0;
+
+        if (ws_state.shm_token) {
+            ws_state.shm_ring =
+                shm_ring_connect(shm_socket_path, ws_state.shm_token, SHM_RING_CAPACITY_DEFAULT, &error);
+
+            if (ws_state.shm_ring) {
+                ALOGI("Sending PCM through shared memory");
+            } else {
+                ALOGW("Shared memory transport unavailable, sending PCM over the websocket: %s", error->message);
+                g_clear_error(&error);
+            }
+        }
+
+        ws_state.audio_buffer = load_wav_bytes_c(
+            "test_audio.wav", &ws_state.channels, &ws_state.sampleRate, &ws_state.bitsPerSample);
         g_assert(ws_state.audio_buffer);
+        ws_state.audio_buffer_size = (int)g_bytes_get_size(ws_state.audio_buffer);
 
-        ws_state.current_chunk_idx = 0;
-        ws_state.chunk_duration = 1; // In seconds
+        ws_state.sent_bytes = 0;
+        ws_state.sent_chunks = 0;
+        ws_state.eos_sent = FALSE;
+        client_reset_rate();
 
         send_pcm_descriptor(FALSE);
 
-        ws_state.timeout_id =
-            g_timeout_add_seconds(ws_state.chunk_duration, G_SOURCE_FUNC(send_pcm), ws_state.connection);
+        if (listen_to_room) {
+            client_send_join();
+        }
+
+        ws_state.stream_start_us = g_get_monotonic_time();
+        ws_state.timeout_id = g_timeout_add(ws_state.rate.chunk_ms, G_SOURCE_FUNC(send_pcm), ws_state.connection);
+        ws_state.probe_id = g_timeout_add(PROBE_INTERVAL_MS, G_SOURCE_FUNC(client_send_probe), ws_state.connection);
         // ws_state.timeout_id = g_timeout_add_seconds(3, G_SOURCE_FUNC(send_test_message), ws_state.connection);
     }
 }
@@ -256,25 +590,48 @@ int create_client(int argc, char *argv[]) {
         websocket_uri = g_strdup(WEBSOCKET_URI_DEFAULT);
     }
 
+    ws_state.json_parser = json_parser_new();
+    ws_state.json_builder = json_builder_new();
+    ws_state.text_buffer = g_string_new(NULL);
+
+    if (capture_path) {
+        ws_state.trace_writer = trace_writer_open(capture_path, TRACE_ROLE_CLIENT, &error);
+        if (!ws_state.trace_writer) {
+            g_print("Failed to start capture: %s\n", error->message);
+            exit(1);
+        }
+    }
+
     SoupSession *soup_session = soup_session_new();
+    SoupMessage *message = soup_message_new(SOUP_METHOD_GET, websocket_uri);
+
+    if (shm_socket_path && shm_ring_supported()) {
+        // The server matches the ring handed over on its Unix socket to this handshake
+        ws_state.shm_token = g_uuid_string_random();
+#if !SOUP_CHECK_VERSION(3, 0, 0)
+        soup_message_headers_append(message->request_headers, SHM_TOKEN_HEADER, ws_state.shm_token);
+#else
+        soup_message_headers_append(soup_message_get_request_headers(message), SHM_TOKEN_HEADER, ws_state.shm_token);
+#endif
+    }
 
 #if !SOUP_CHECK_VERSION(3, 0, 0)
-    soup_session_websocket_connect_async(soup_session,                                     // session
-                                         soup_message_new(SOUP_METHOD_GET, websocket_uri), // message
-                                         NULL,                                             // origin
-                                         NULL,                                             // protocols
-                                         NULL,                                             // cancellable
-                                         websocket_connected_cb,                           // callback
-                                         NULL);                                            // user_data
+    soup_session_websocket_connect_async(soup_session,           // session
+                                         message,                // message
+                                         NULL,                   // origin
+                                         NULL,                   // protocols
+                                         NULL,                   // cancellable
+                                         websocket_connected_cb, // callback
+                                         NULL);                  // user_data
 #else
-    soup_session_websocket_connect_async(soup_session,                                     // session
-                                         soup_message_new(SOUP_METHOD_GET, websocket_uri), // message
-                                         NULL,                                             // origin
-                                         NULL,                                             // protocols
-                                         0,                                                // io_priority
-                                         NULL,                                             // cancellable
-                                         websocket_connected_cb,                           // callback
-                                         NULL);                                            // user_data
+    soup_session_websocket_connect_async(soup_session,           // session
+                                         message,                // message
+                                         NULL,                   // origin
+                                         NULL,                   // protocols
+                                         0,                      // io_priority
+                                         NULL,                   // cancellable
+                                         websocket_connected_cb, // callback
+                                         NULL);                  // user_data
 #endif
 
     GMainLoop *loop = g_main_loop_new(NULL, FALSE);
@@ -287,6 +644,18 @@ int create_client(int argc, char *argv[]) {
     // Cleanup
     g_main_loop_unref(loop);
     g_clear_pointer(&websocket_uri, g_free);
+    g_clear_pointer(&ws_state.trace_writer, trace_writer_close);
+    g_clear_pointer(&capture_path, g_free);
+    g_clear_pointer(&room, g_free);
+    g_clear_pointer(&ws_state.shm_ring, shm_ring_free);
+    g_clear_pointer(&ws_state.audio_buffer, g_bytes_unref);
+    g_clear_pointer(&ws_state.shm_token, g_free);
+    g_queue_clear_full(&ws_state.probes, g_free);
+    g_clear_object(&ws_state.json_parser);
+    g_clear_object(&ws_state.json_builder);
+    g_string_free(ws_state.text_buffer, TRUE);
+    ws_state.text_buffer = NULL;
+    g_clear_pointer(&shm_socket_path, g_free);
 
     return 0;
 }
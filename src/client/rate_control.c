@@ -0,0 +1,78 @@
+#include "rate_control.h"
+
+/// The RTT baseline is the minimum over this window, so that it can follow a route change
+#define RTT_MIN_WINDOW_US (10 * G_USEC_PER_SEC)
+/// Jitter allowance on top of the baseline, loopback RTTs are too small to compare against on their own
+#define RTT_SLACK_US 5000
+
+void rate_control_reset(RateControl *rate, gint sample_rate, gsize frame_size, gint64 now_us) {
+    rate->sample_rate = sample_rate;
+    rate->frame_size = frame_size;
+    rate->chunk_ms = CHUNK_MS_INITIAL;
+    rate->srtt_us = 0;
+    rate->rtt_min_us = G_MAXINT64;
+    rate->rtt_window_min_us = G_MAXINT64;
+    rate->rtt_window_start_us = now_us;
+    rate->last_decrease_us = 0;
+
+    rate_control_update_inflight_limit(rate);
+}
+
+gsize rate_control_ms_to_bytes(const RateControl *rate, gint64 ms) {
+    return (gsize)(ms * rate->sample_rate / 1000) * rate->frame_size;
+}
+
+void rate_control_update_inflight_limit(RateControl *rate) {
+    // One RTT of audio on the way plus a chunk being acknowledged and the next one ready, with headroom for jitter.
+    // Acknowledgements only come with pongs, everything sent in between has to fit as well.
+    rate->inflight_limit =
+        rate_control_ms_to_bytes(rate, 2 * (rate->chunk_ms + rate->srtt_us / 1000) + PROBE_INTERVAL_MS);
+}
+
+void rate_control_update_rtt(RateControl *rate, gint64 rtt_us, gint64 now_us) {
+    rate->srtt_us = rate->srtt_us == 0 ? rtt_us : (7 * rate->srtt_us + rtt_us) / 8;
+
+    if (now_us - rate->rtt_window_start_us >= RTT_MIN_WINDOW_US) {
+        rate->rtt_min_us = MIN(rate->rtt_window_min_us, rtt_us);
+        rate->rtt_window_min_us = rtt_us;
+        rate->rtt_window_start_us = now_us;
+    } else {
+        rate->rtt_window_min_us = MIN(rate->rtt_window_min_us, rtt_us);
+        rate->rtt_min_us = MIN(rate->rtt_min_us, rtt_us);
+    }
+
+    rate_control_update_inflight_limit(rate);
+}
+
+guint rate_control_adapt(RateControl *rate, gboolean paused, gsize unacked_bytes, gint64 now_us) {
+    guint previous_ms = rate->chunk_ms;
+    guint chunk_ms = previous_ms;
+
+    gboolean latency_rising = rate->srtt_us > 2 * rate->rtt_min_us + RTT_SLACK_US;
+    gboolean stable = rate->srtt_us <= rate->rtt_min_us + rate->rtt_min_us / 4 + RTT_SLACK_US &&
+                      unacked_bytes <= rate->inflight_limit / 2;
+
+    if (paused || latency_rising) {
+        // At most once per RTT, the smoothed RTT takes a while to come down after a decrease
+        if (now_us - rate->last_decrease_us >= MAX(rate->srtt_us, PROBE_INTERVAL_MS * 1000)) {
+            chunk_ms = MAX(CHUNK_MS_MIN, chunk_ms / 2);
+            rate->last_decrease_us = now_us;
+        }
+    } else if (stable) {
+        chunk_ms = MIN(CHUNK_MS_MAX, chunk_ms + CHUNK_MS_STEP);
+    }
+
+    rate->chunk_ms = chunk_ms;
+    rate_control_update_inflight_limit(rate);
+
+    return previous_ms;
+}
+
+gboolean rate_control_may_send(const RateControl *rate, gsize unacked_bytes, gsize size) {
+    // Nothing is held back until the server has answered a probe, it may not support them
+    if (rate->srtt_us == 0 || unacked_bytes == 0) {
+        return TRUE;
+    }
+
+    return unacked_bytes + size <= rate->inflight_limit;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * PCM send rate adaptation of the client.
+ *
+ * The client probes the server with pings, every pong acknowledges the audio sent before its ping and gives an RTT
+ * sample. Queueing anywhere between the client and the server's handler shows up as RTT above the baseline. Small
+ * chunks keep latency down while it lasts, large ones save per-message overhead once the link keeps up. The audio
+ * that is sent but not acknowledged yet is bounded by an in-flight limit derived from the chunk size and the RTT.
+ */
+
+/// PCM chunk duration bounds, the chunk grows by one step per stable probe and halves when latency rises
+#define CHUNK_MS_MIN 20
+#define CHUNK_MS_MAX 1000
+#define CHUNK_MS_INITIAL 200
+#define CHUNK_MS_STEP 20
+
+/// Pongs are the only acknowledgements, so this is also how often the in-flight window opens
+#define PROBE_INTERVAL_MS 250
+
+typedef struct {
+    gint sample_rate;
+    gsize frame_size;
+
+    guint chunk_ms;
+    /// Sent bytes the server hasn't acknowledged may not exceed this
+    gsize inflight_limit;
+
+    gint64 srtt_us;
+    gint64 rtt_min_us;
+    gint64 rtt_window_min_us;
+    gint64 rtt_window_start_us;
+    gint64 last_decrease_us;
+} RateControl;
+
+void rate_control_reset(RateControl *rate, gint sample_rate, gsize frame_size, gint64 now_us);
+
+gsize rate_control_ms_to_bytes(const RateControl *rate, gint64 ms);
+
+/// Recomputes the in-flight limit from the current chunk size and RTT.
+void rate_control_update_inflight_limit(RateControl *rate);
+
+/// Takes the RTT sample of an answered probe, the in-flight limit follows it.
+void rate_control_update_rtt(RateControl *rate, gint64 rtt_us, gint64 now_us);
+
+/// Adapts the chunk size after a pong. Returns the previous chunk size.
+guint rate_control_adapt(RateControl *rate, gboolean paused, gsize unacked_bytes, gint64 now_us);
+
+/// Whether another chunk of size bytes may be sent with unacked_bytes still in flight.
+gboolean rate_control_may_send(const RateControl *rate, gsize unacked_bytes, gsize size);
+
+#ifdef __cplusplus
+}
+#endif
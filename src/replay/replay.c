@@ -0,0 +1,668 @@
+#include "replay.h"
+
+#ifdef __linux__
+    #include <glib-unix.h>
+#endif
+#include <json-glib/json-glib.h>
+#include <libsoup/soup-message.h>
+#include <libsoup/soup-session.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../utils/logger.h"
+#include "../utils/shm_ring.h"
+#include "../utils/trace.h"
+
+#define WEBSOCKET_URI_DEFAULT "ws://127.0.0.1:8080/ws"
+
+/// Frames sent per main loop iteration when replaying as fast as possible
+#define REPLAY_BATCH_SIZE 64
+
+/// Retry interval while a shared memory ring is full
+#define REPLAY_RING_FULL_RETRY_MS 1
+
+/// Default time the server gets to answer the final probes once every frame is sent
+#define REPLAY_DRAIN_TIMEOUT_S_DEFAULT 30
+
+static gchar *websocket_uri = NULL;
+static gchar *trace_path = NULL;
+static gdouble speed = 1.0;
+static gint probe_interval_ms = 100;
+static gchar *shm_socket_path = NULL;
+static gint drain_timeout_s = REPLAY_DRAIN_TIMEOUT_S_DEFAULT;
+
+static GOptionEntry options[] = {{
+                                     "websocket-uri",
+                                     'u',
+                                     0,
+                                     G_OPTION_ARG_STRING,
+                                     &websocket_uri,
+                                     "Websocket URI",
+                                     "URI",
+                                 },
+                                 {
+                                     "trace",
+                                     't',
+                                     0,
+                                     G_OPTION_ARG_FILENAME,
+                                     &trace_path,
+                                     "Trace file recorded with --capture",
+                                     "FILE",
+                                 },
+                                 {
+                                     "speed",
+                                     's',
+                                     0,
+                                     G_OPTION_ARG_DOUBLE,
+                                     &speed,
+                                     "Replay speed factor, 0 replays as fast as possible",
+                                     "N",
+                                 },
+                                 {
+                                     "probe-interval",
+                                     'p',
+                                     0,
+                                     G_OPTION_ARG_INT,
+                                     &probe_interval_ms,
+                                     "Interval between latency probes in milliseconds",
+                                     "MS",
+                                 },
+                                 {
+                                     "shm-socket",
+                                     0,
+                                     0,
+                                     G_OPTION_ARG_FILENAME,
+                                     &shm_socket_path,
+                                     "Send binary frames through shared memory to a server on this host",
+                                     "PATH",
+                                 },
+                                 {
+                                     "drain-timeout",
+                                     0,
+                                     0,
+                                     G_OPTION_ARG_INT,
+                                     &drain_timeout_s,
+                                     "Seconds to wait for the final probes once every frame is sent",
+                                     "S",
+                                 },
+                                 {NULL}};
+
+typedef struct {
+    /// Offset from the first replayed frame in the trace
+    gint64 offset_us;
+    guint32 stream;
+    TraceFrameType type;
+    GBytes *payload;
+} ReplayFrame;
+
+typedef struct {
+    guint32 id;
+    SoupWebsocketConnection *connection;
+
+    gchar *shm_token;
+    ShmRing *shm_ring;
+    /// Tags ring frames, the server holds a frame back until it has handled the websocket messages sent before it
+    guint32 websocket_messages_sent;
+
+    /// Probes sent by this replay and not answered yet, seq -> send time
+    GHashTable *probe_times;
+    gint64 final_probe_seq;
+    gboolean finished;
+} ReplayStream;
+
+struct ReplayState {
+    GMainLoop *loop;
+    SoupSession *session;
+
+    GArray *frames;
+    guint next_frame;
+
+    /// Stream id -> ReplayStream
+    GHashTable *streams;
+    guint pending_connections;
+    guint finished_streams;
+
+    guint pump_id;
+    guint probe_id;
+    gint64 probe_seq;
+
+    guint drain_timeout_id;
+    /// Some final probes were never answered, the replay exits with an error
+    gboolean timed_out;
+
+    gint64 start_us;
+    gint64 end_us;
+
+    guint64 frames_sent;
+    guint64 bytes_sent;
+    guint64 shm_frames_sent;
+    gint64 lag_total_us;
+    gint64 lag_max_us;
+
+    /// Round trip times of the latency probes
+    GArray *latencies_us;
+};
+
+static struct ReplayState replay_state = {};
+
+static gboolean sigint_handler(gpointer user_data) {
+    g_main_loop_quit(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+static void replay_frame_clear(gpointer data) {
+    ReplayFrame *frame = data;
+    g_clear_pointer(&frame->payload, g_bytes_unref);
+}
+
+static void replay_stream_free(gpointer data) {
+    ReplayStream *stream = data;
+    if (stream->connection) {
+        g_signal_handlers_disconnect_by_data(stream->connection, stream);
+        g_clear_object(&stream->connection);
+    }
+    g_clear_pointer(&stream->shm_ring, shm_ring_free);
+    g_hash_table_unref(stream->probe_times);
+    g_free(stream->shm_token);
+    g_free(stream);
+}
+
+/// Latency probes of the captured session, the replay sends its own.
+static gboolean replay_frame_is_ping(TraceFrameType type, GBytes *payload) {
+    if (type != TRACE_FRAME_TEXT) return FALSE;
+
+    gsize length = 0;
+    const gchar *data = g_bytes_get_data(payload, &length);
+
+    JsonParser *parser = json_parser_new();
+    gboolean is_ping = FALSE;
+
+    if (json_parser_load_from_data(parser, data, length, NULL)) {
+        JsonNode *root = json_parser_get_root(parser);
+
+        if (root && JSON_NODE_HOLDS_OBJECT(root)) {
+            JsonNode *msg = json_object_get_member(json_node_get_object(root), "msg");
+            is_ping = msg && JSON_NODE_HOLDS_VALUE(msg) && json_node_get_value_type(msg) == G_TYPE_STRING &&
+                      g_str_equal(json_node_get_string(msg), "ping");
+        }
+    }
+
+    g_object_unref(parser);
+
+    return is_ping;
+}
+
+/// Loads the frames which the client originally sent, whichever side the trace was captured on.
+static gboolean replay_load_trace(const char *path, GError **error) {
+    TraceReader *reader = trace_reader_open(path, error);
+    if (!reader) {
+        return FALSE;
+    }
+
+    TraceDirection sent_direction =
+        trace_reader_get_role(reader) == TRACE_ROLE_CLIENT ? TRACE_DIRECTION_OUT : TRACE_DIRECTION_IN;
+
+    replay_state.frames = g_array_new(FALSE, FALSE, sizeof(ReplayFrame));
+    g_array_set_clear_func(replay_state.frames, replay_frame_clear);
+
+    replay_state.streams = g_hash_table_new_full(NULL, NULL, NULL, replay_stream_free);
+
+    gint64 first_timestamp_us = -1;
+    TraceRecord record;
+
+    while (trace_reader_next(reader, &record)) {
+        if (record.direction != sent_direction || replay_frame_is_ping(record.type, record.payload)) {
+            g_bytes_unref(record.payload);
+            continue;
+        }
+
+        if (first_timestamp_us < 0) {
+            first_timestamp_us = record.timestamp_us;
+        }
+
+        ReplayFrame frame = {
+            .offset_us = record.timestamp_us - first_timestamp_us,
+            .stream = record.stream,
+            .type = record.type,
+            .payload = record.payload,
+        };
+        g_array_append_val(replay_state.frames, frame);
+
+        if (!g_hash_table_contains(replay_state.streams, GUINT_TO_POINTER(record.stream))) {
+            ReplayStream *stream = g_new0(ReplayStream, 1);
+            stream->id = record.stream;
+            stream->probe_times = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+            stream->final_probe_seq = -1;
+            g_hash_table_insert(replay_state.streams, GUINT_TO_POINTER(record.stream), stream);
+        }
+    }
+
+    trace_reader_close(reader);
+
+    ALOGI("Loaded %u frames in %u streams from %s",
+          replay_state.frames->len,
+          g_hash_table_size(replay_state.streams),
+          path);
+
+    return TRUE;
+}
+
+static gint compare_gint64(gconstpointer a, gconstpointer b) {
+    gint64 lhs = *(const gint64 *)a;
+    gint64 rhs = *(const gint64 *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static gint64 latency_percentile(gdouble percentile) {
+    GArray *latencies = replay_state.latencies_us;
+    guint index = (guint)(percentile / 100.0 * (latencies->len - 1) + 0.5);
+    return g_array_index(latencies, gint64, index);
+}
+
+static void replay_report() {
+    gdouble duration_s = (replay_state.end_us - replay_state.start_us) / (gdouble)G_USEC_PER_SEC;
+
+    if (speed > 0) {
+        g_print("Replay finished at %.2fx speed\n", speed);
+    } else {
+        g_print("Replay finished as fast as possible\n");
+    }
+    g_print("  duration:   %.3f s\n", duration_s);
+    g_print("  frames:     %" G_GUINT64_FORMAT "\n", replay_state.frames_sent);
+    g_print("  bytes:      %" G_GUINT64_FORMAT "\n", replay_state.bytes_sent);
+    g_print("  transport:  %" G_GUINT64_FORMAT " frames through shared memory\n", replay_state.shm_frames_sent);
+
+    if (duration_s > 0) {
+        g_print("  throughput: %.1f frames/s, %.3f MB/s\n",
+                replay_state.frames_sent / duration_s,
+                replay_state.bytes_sent / duration_s / (1024.0 * 1024.0));
+    }
+
+    if (replay_state.frames_sent > 0) {
+        g_print("  send lag:   avg %.3f ms, max %.3f ms\n",
+                replay_state.lag_total_us / (gdouble)replay_state.frames_sent / 1000.0,
+                replay_state.lag_max_us / 1000.0);
+    }
+
+    GArray *latencies = replay_state.latencies_us;
+    if (latencies->len > 0) {
+        g_array_sort(latencies, compare_gint64);
+
+        gint64 total_us = 0;
+        for (guint i = 0; i < latencies->len; i++) {
+            total_us += g_array_index(latencies, gint64, i);
+        }
+
+        g_print("  latency:    %u probes, min %.3f ms, avg %.3f ms, p50 %.3f ms, p95 %.3f ms, max %.3f ms\n",
+                latencies->len,
+                g_array_index(latencies, gint64, 0) / 1000.0,
+                total_us / (gdouble)latencies->len / 1000.0,
+                latency_percentile(50) / 1000.0,
+                latency_percentile(95) / 1000.0,
+                g_array_index(latencies, gint64, latencies->len - 1) / 1000.0);
+    }
+}
+
+static void replay_stream_finish(ReplayStream *stream) {
+    if (stream->finished) return;
+
+    stream->finished = TRUE;
+    replay_state.finished_streams++;
+
+    if (replay_state.finished_streams == g_hash_table_size(replay_state.streams)) {
+        g_clear_handle_id(&replay_state.drain_timeout_id, g_source_remove);
+
+        replay_state.end_us = g_get_monotonic_time();
+        replay_report();
+        g_main_loop_quit(replay_state.loop);
+    }
+}
+
+static gint64 replay_send_probe(ReplayStream *stream) {
+    gint64 seq = replay_state.probe_seq++;
+
+    gint64 *sent_us = g_new(gint64, 1);
+    *sent_us = g_get_monotonic_time();
+    g_hash_table_insert(stream->probe_times, GSIZE_TO_POINTER(seq), sent_us);
+
+    gchar *msg_str =
+        g_strdup_printf("{\"msg\":\"ping\",\"seq\":%" G_GINT64_FORMAT ",\"time\":%" G_GINT64_FORMAT "}",
+                        seq,
+                        *sent_us);
+    soup_websocket_connection_send_text(stream->connection, msg_str);
+    stream->websocket_messages_sent++;
+    g_free(msg_str);
+
+    return seq;
+}
+
+static gboolean replay_probe_cb(gpointer user_data) {
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, replay_state.streams);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ReplayStream *stream = value;
+        if (!stream->finished && soup_websocket_connection_get_state(stream->connection) == SOUP_WEBSOCKET_STATE_OPEN) {
+            replay_send_probe(stream);
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/// The server didn't answer every final probe in time, reports what is missing and gives up.
+static gboolean replay_drain_timeout_cb(gpointer user_data) {
+    replay_state.drain_timeout_id = 0;
+    replay_state.timed_out = TRUE;
+
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, replay_state.streams);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ReplayStream *stream = value;
+        if (stream->finished) continue;
+
+        g_print("Stream %u: final probe %" G_GINT64_FORMAT " unanswered after %d s, %u pongs missing\n",
+                stream->id,
+                stream->final_probe_seq,
+                drain_timeout_s,
+                g_hash_table_size(stream->probe_times));
+    }
+
+    replay_state.end_us = g_get_monotonic_time();
+    replay_report();
+    g_main_loop_quit(replay_state.loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+/// Every frame has been sent, the last probe on each stream tells when the server has drained it.
+static void replay_send_final_probes() {
+    g_clear_handle_id(&replay_state.probe_id, g_source_remove);
+
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, replay_state.streams);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ReplayStream *stream = value;
+        if (stream->finished) continue;
+
+        stream->final_probe_seq = replay_send_probe(stream);
+    }
+
+    if (replay_state.finished_streams < g_hash_table_size(replay_state.streams)) {
+        replay_state.drain_timeout_id =
+            g_timeout_add_seconds((guint)drain_timeout_s, G_SOURCE_FUNC(replay_drain_timeout_cb), NULL);
+    }
+}
+
+/// Returns FALSE if the frame has to wait for room in the shared memory ring.
+static gboolean replay_send_frame(ReplayStream *stream, ReplayFrame *frame) {
+    gsize size = 0;
+    gconstpointer data = g_bytes_get_data(frame->payload, &size);
+
+    // Binary frames that fit take the ring, the sequence orders them against the websocket messages
+    if (stream->shm_ring && frame->type == TRACE_FRAME_BINARY &&
+        size <= shm_ring_get_max_message_size(stream->shm_ring)) {
+        if (!shm_ring_write(stream->shm_ring, stream->websocket_messages_sent, data, size)) {
+            return FALSE;
+        }
+
+        replay_state.shm_frames_sent++;
+        return TRUE;
+    }
+
+    soup_websocket_connection_send_message(stream->connection, frame->type, frame->payload);
+    stream->websocket_messages_sent++;
+
+    return TRUE;
+}
+
+static gboolean replay_pump(gpointer user_data) {
+    replay_state.pump_id = 0;
+
+    gint64 elapsed_us = g_get_monotonic_time() - replay_state.start_us;
+    guint batch = 0;
+
+    while (replay_state.next_frame < replay_state.frames->len) {
+        ReplayFrame *frame = &g_array_index(replay_state.frames, ReplayFrame, replay_state.next_frame);
+
+        gint64 due_us = speed > 0 ? (gint64)(frame->offset_us / speed) : 0;
+
+        if (due_us > elapsed_us) {
+            replay_state.pump_id =
+                g_timeout_add((guint)((due_us - elapsed_us) / 1000), G_SOURCE_FUNC(replay_pump), NULL);
+            return G_SOURCE_REMOVE;
+        }
+
+        if (speed <= 0 && batch++ == REPLAY_BATCH_SIZE) {
+            // Let the connections flush and the probes come back
+            replay_state.pump_id = g_idle_add(G_SOURCE_FUNC(replay_pump), NULL);
+            return G_SOURCE_REMOVE;
+        }
+
+        ReplayStream *stream = g_hash_table_lookup(replay_state.streams, GUINT_TO_POINTER(frame->stream));
+
+        if (!stream->finished) {
+            if (!replay_send_frame(stream, frame)) {
+                replay_state.pump_id =
+                    g_timeout_add(REPLAY_RING_FULL_RETRY_MS, G_SOURCE_FUNC(replay_pump), NULL);
+                return G_SOURCE_REMOVE;
+            }
+
+            gint64 lag_us = elapsed_us - due_us;
+            replay_state.lag_total_us += lag_us;
+            replay_state.lag_max_us = MAX(replay_state.lag_max_us, lag_us);
+
+            replay_state.frames_sent++;
+            replay_state.bytes_sent += g_bytes_get_size(frame->payload);
+        }
+
+        replay_state.next_frame++;
+    }
+
+    replay_send_final_probes();
+
+    return G_SOURCE_REMOVE;
+}
+
+static void replay_start() {
+    ALOGI("All streams connected, replaying");
+
+    replay_state.start_us = g_get_monotonic_time();
+    replay_state.pump_id = g_idle_add(G_SOURCE_FUNC(replay_pump), NULL);
+
+    if (probe_interval_ms > 0) {
+        replay_state.probe_id = g_timeout_add(probe_interval_ms, G_SOURCE_FUNC(replay_probe_cb), NULL);
+    }
+}
+
+static void replay_handle_pong(ReplayStream *stream, GBytes *message) {
+    gsize length = 0;
+    const gchar *msg_data = g_bytes_get_data(message, &length);
+
+    JsonParser *parser = json_parser_new();
+
+    if (json_parser_load_from_data(parser, msg_data, length, NULL)) {
+        JsonNode *root = json_parser_get_root(parser);
+
+        if (root && JSON_NODE_HOLDS_OBJECT(root)) {
+            JsonObject *msg = json_node_get_object(root);
+
+            JsonNode *type = json_object_get_member(msg, "msg");
+            JsonNode *seq_node = json_object_get_member(msg, "seq");
+
+            // Only pongs to probes of this replay are measured, against the send time recorded here
+            if (type && JSON_NODE_HOLDS_VALUE(type) && json_node_get_value_type(type) == G_TYPE_STRING &&
+                g_str_equal(json_node_get_string(type), "pong") && seq_node && JSON_NODE_HOLDS_VALUE(seq_node) &&
+                json_node_get_value_type(seq_node) == G_TYPE_INT64) {
+                gint64 seq = json_node_get_int(seq_node);
+                gint64 *sent_us = g_hash_table_lookup(stream->probe_times, GSIZE_TO_POINTER(seq));
+
+                if (sent_us) {
+                    gint64 latency_us = g_get_monotonic_time() - *sent_us;
+                    g_array_append_val(replay_state.latencies_us, latency_us);
+                    g_hash_table_remove(stream->probe_times, GSIZE_TO_POINTER(seq));
+
+                    if (seq == stream->final_probe_seq) {
+                        replay_stream_finish(stream);
+                    }
+                }
+            }
+        }
+    }
+
+    g_object_unref(parser);
+}
+
+static void replay_message_cb(SoupWebsocketConnection *connection, gint type, GBytes *message, gpointer user_data) {
+    // Replies other than pongs belong to the replayed session and are not measured
+    if (type == SOUP_WEBSOCKET_DATA_TEXT) {
+        replay_handle_pong(user_data, message);
+    }
+}
+
+static void replay_closed_cb(SoupWebsocketConnection *connection, gpointer user_data) {
+    ReplayStream *stream = user_data;
+
+    ALOGW("Stream %u closed before the replay finished", stream->id);
+
+    replay_stream_finish(stream);
+}
+
+static void replay_connected_cb(GObject *session, GAsyncResult *res, gpointer user_data) {
+    ReplayStream *stream = user_data;
+    GError *error = NULL;
+
+    stream->connection = soup_session_websocket_connect_finish(SOUP_SESSION(session), res, &error);
+
+    if (error) {
+        g_print("Error creating websocket for stream %u: %s\n", stream->id, error->message);
+        g_clear_error(&error);
+        g_main_loop_quit(replay_state.loop);
+        return;
+    }
+
+    g_signal_connect(stream->connection, "message", G_CALLBACK(replay_message_cb), stream);
+    g_signal_connect(stream->connection, "closed", G_CALLBACK(replay_closed_cb), stream);
+
+    if (stream->shm_token) {
+        stream->shm_ring = shm_ring_connect(shm_socket_path, stream->shm_token, SHM_RING_CAPACITY_DEFAULT, &error);
+
+        if (!stream->shm_ring) {
+            ALOGW("Stream %u falls back to websocket frames: %s", stream->id, error->message);
+            g_clear_error(&error);
+        }
+    }
+
+    if (--replay_state.pending_connections == 0) {
+        replay_start();
+    }
+}
+
+static void replay_connect_streams() {
+    GHashTableIter iter;
+    gpointer value;
+
+    replay_state.pending_connections = g_hash_table_size(replay_state.streams);
+
+    g_hash_table_iter_init(&iter, replay_state.streams);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ReplayStream *stream = value;
+        SoupMessage *message = soup_message_new(SOUP_METHOD_GET, websocket_uri);
+
+        if (shm_socket_path && shm_ring_supported()) {
+            stream->shm_token = g_uuid_string_random();
+#if !SOUP_CHECK_VERSION(3, 0, 0)
+            soup_message_headers_append(message->request_headers, SHM_TOKEN_HEADER, stream->shm_token);
+#else
+            soup_message_headers_append(soup_message_get_request_headers(message), SHM_TOKEN_HEADER, stream->shm_token);
+#endif
+        }
+
+#if !SOUP_CHECK_VERSION(3, 0, 0)
+        soup_session_websocket_connect_async(replay_state.session, // session
+                                             message,              // message
+                                             NULL,                 // origin
+                                             NULL,                 // protocols
+                                             NULL,                 // cancellable
+                                             replay_connected_cb,  // callback
+                                             stream);              // user_data
+#else
+        soup_session_websocket_connect_async(replay_state.session, // session
+                                             message,              // message
+                                             NULL,                 // origin
+                                             NULL,                 // protocols
+                                             0,                    // io_priority
+                                             NULL,                 // cancellable
+                                             replay_connected_cb,  // callback
+                                             stream);              // user_data
+#endif
+    }
+}
+
+int create_replay(int argc, char *argv[]) {
+    GError *error = NULL;
+
+    GOptionContext *option_context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(option_context, options, NULL);
+
+    if (!g_option_context_parse(option_context, &argc, &argv, &error)) {
+        g_print("Option context parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(option_context);
+
+    if (!trace_path) {
+        g_print("A trace file is required, see --help\n");
+        exit(1);
+    }
+
+    if (drain_timeout_s <= 0) {
+        g_print("The drain timeout must be positive\n");
+        exit(1);
+    }
+
+    if (!websocket_uri) {
+        websocket_uri = g_strdup(WEBSOCKET_URI_DEFAULT);
+    }
+
+    if (!replay_load_trace(trace_path, &error)) {
+        g_print("Failed to load trace: %s\n", error->message);
+        exit(1);
+    }
+
+    if (replay_state.frames->len == 0) {
+        g_print("Trace contains no frames sent by the client\n");
+        exit(1);
+    }
+
+    replay_state.latencies_us = g_array_new(FALSE, FALSE, sizeof(gint64));
+    replay_state.session = soup_session_new();
+    replay_state.loop = g_main_loop_new(NULL, FALSE);
+#ifdef __linux__
+    g_unix_signal_add(SIGINT, sigint_handler, replay_state.loop);
+#endif
+
+    replay_connect_streams();
+
+    g_main_loop_run(replay_state.loop);
+
+    // Cleanup
+    g_clear_handle_id(&replay_state.pump_id, g_source_remove);
+    g_clear_handle_id(&replay_state.probe_id, g_source_remove);
+    g_clear_handle_id(&replay_state.drain_timeout_id, g_source_remove);
+    g_clear_pointer(&replay_state.streams, g_hash_table_unref);
+    g_clear_pointer(&replay_state.frames, g_array_unref);
+    g_clear_pointer(&replay_state.latencies_us, g_array_unref);
+    g_clear_object(&replay_state.session);
+    g_main_loop_unref(replay_state.loop);
+    g_clear_pointer(&websocket_uri, g_free);
+    g_clear_pointer(&trace_path, g_free);
+    g_clear_pointer(&shm_socket_path, g_free);
+
+    return replay_state.timed_out ? 1 : 0;
+}
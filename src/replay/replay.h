@@ -0,0 +1,12 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Replay the client side of a captured trace against a server and report latency and throughput.
+int create_replay(int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,69 @@
+#include "control_message.h"
+
+JsonObject *control_message_parse(JsonParser *parser, GBytes *message, GError **error) {
+    gsize length = 0;
+    const gchar *data = g_bytes_get_data(message, &length);
+
+    if (!json_parser_load_from_data(parser, data, (gssize)length, error)) {
+        return NULL;
+    }
+
+    JsonNode *root = json_parser_get_root(parser);
+    if (!root || !JSON_NODE_HOLDS_OBJECT(root)) {
+        return NULL;
+    }
+
+    return json_node_get_object(root);
+}
+
+/// G_TYPE_INVALID unless the member exists and holds a value.
+static GType control_message_get_value_type(JsonObject *msg, const gchar *member) {
+    JsonNode *node = json_object_get_member(msg, member);
+
+    if (!node || !JSON_NODE_HOLDS_VALUE(node)) {
+        return G_TYPE_INVALID;
+    }
+
+    return json_node_get_value_type(node);
+}
+
+gint64 control_message_get_int(JsonObject *msg, const gchar *member, gint64 default_value) {
+    if (control_message_get_value_type(msg, member) != G_TYPE_INT64) {
+        return default_value;
+    }
+
+    return json_object_get_int_member(msg, member);
+}
+
+gdouble control_message_get_double(JsonObject *msg, const gchar *member, gdouble default_value) {
+    GType type = control_message_get_value_type(msg, member);
+
+    if (type != G_TYPE_DOUBLE && type != G_TYPE_INT64) {
+        return default_value;
+    }
+
+    return json_object_get_double_member(msg, member);
+}
+
+gboolean control_message_get_boolean(JsonObject *msg, const gchar *member, gboolean default_value) {
+    if (control_message_get_value_type(msg, member) != G_TYPE_BOOLEAN) {
+        return default_value;
+    }
+
+    return json_object_get_boolean_member(msg, member);
+}
+
+const gchar *control_message_format_pong(Arena *arena, JsonObject *ping) {
+    // Echo the sequence number and send time so that the peer can match the round trip
+    const gchar *seq = "";
+    if (control_message_get_value_type(ping, "seq") == G_TYPE_INT64) {
+        seq = arena_strdup_printf(arena, ",\"seq\":%" G_GINT64_FORMAT, json_object_get_int_member(ping, "seq"));
+    }
+
+    const gchar *time = "";
+    if (control_message_get_value_type(ping, "time") == G_TYPE_INT64) {
+        time = arena_strdup_printf(arena, ",\"time\":%" G_GINT64_FORMAT, json_object_get_int_member(ping, "time"));
+    }
+
+    return arena_strdup_printf(arena, "{\"msg\":\"pong\"%s%s}", seq, time);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "../utils/arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * JSON control messages, as the server parses and answers them.
+ *
+ * Shared with the allocation benchmark, so that it measures the server's own code path.
+ */
+
+/// Loads a text message into parser, which may be reused across messages. Returns NULL with error unset if the message
+/// is valid JSON but not an object. The object is valid until the parser loads the next message.
+JsonObject *control_message_parse(JsonParser *parser, GBytes *message, GError **error);
+
+/// Members missing or of another type read as default_value. Unlike json-glib's getters, no critical is logged for
+/// them, clients may send anything.
+gint64 control_message_get_int(JsonObject *msg, const gchar *member, gint64 default_value);
+
+/// Integer members are read as well.
+gdouble control_message_get_double(JsonObject *msg, const gchar *member, gdouble default_value);
+
+gboolean control_message_get_boolean(JsonObject *msg, const gchar *member, gboolean default_value);
+
+/// The answer to a ping, echoing its sequence number and send time if they are integers. Allocated from arena.
+const gchar *control_message_format_pong(Arena *arena, JsonObject *ping);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,616 @@
+#include "mixer.h"
+
+#include <gio/gio.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+#include "../utils/buffer_pool.h"
+#include "../utils/logger.h"
+
+/// Mixing period, every room produces one chunk of this duration per tick
+#define MIXER_TICK_MS 20
+
+/// CPU time the worker may spend per tick across all rooms, rooms left over are served first on the next tick
+#define MIXER_TICK_BUDGET_US 5000
+
+/// How far the room timeline lags behind the wall clock, absorbs network jitter
+#define MIXER_PLAYOUT_DELAY_MS 200
+
+/// Queued audio per stream, anything beyond is dropped
+#define MIXER_STREAM_BUFFER_MS 4000
+
+#define MIXER_MAX_STREAMS_PER_ROOM 16
+
+/// Formats come from clients, these bound what a stream can make the mixer allocate
+#define MIXER_MAX_SAMPLE_RATE 192000
+#define MIXER_MAX_CHANNELS 8
+
+/// A room that fell further behind than this skips ahead instead of bursting
+#define MIXER_MAX_CATCH_UP_TICKS 5
+
+/// Gains are fixed point with this many fractional bits
+#define MIXER_GAIN_SHIFT 12
+#define MIXER_GAIN_UNITY (1 << MIXER_GAIN_SHIFT)
+
+#define MIXER_STATS_INTERVAL_US (10 * G_USEC_PER_SEC)
+
+typedef struct _MixerRoom MixerRoom;
+
+typedef struct {
+    gpointer id;
+    MixerRoom *room;
+
+    gint32 gain;
+
+    /// Ring buffer indexed by absolute room frame position modulo capacity
+    gint16 *ring;
+    guint64 capacity_frames;
+
+    gboolean positioned;
+    /// Queued audio spans [read_pos, write_pos) of the room timeline
+    guint64 read_pos;
+    guint64 write_pos;
+
+    gboolean ended;
+} MixerStream;
+
+struct _MixerRoom {
+    /// Shared with the outputs in flight
+    GRefString *name;
+    gint32 sample_rate;
+    guint8 channels;
+
+    gint64 start_us;
+    /// Frames of the room timeline mixed so far
+    guint64 mixed_pos;
+
+    GPtrArray *streams;
+
+    guint tick_frames;
+    gint16 *mix_buffer;
+    gint16 *scratch_buffer;
+};
+
+/// Outlives the mixer, so that outputs still queued on the main context can tell it is gone.
+typedef struct {
+    gint ref_count;
+    gboolean alive;
+    MixerOutputFunc output_func;
+    gpointer user_data;
+} MixerSink;
+
+/// Pooled, like the PCM it carries, a tick doesn't allocate once the pool is warm.
+typedef struct {
+    MixerSink *sink;
+    GRefString *room;
+    GBytes *pcm;
+} MixerOutput;
+
+struct _Mixer {
+    GMainContext *context;
+    MixerSink *sink;
+
+    GMutex mutex;
+    GCond cond;
+    gboolean running;
+    GThread *thread;
+
+    /// Room name -> MixerRoom
+    GHashTable *rooms;
+    /// Stream id -> MixerStream
+    GHashTable *streams;
+
+    /// Round-robin order, so that rooms skipped because of the budget go first on the next tick
+    GPtrArray *room_order;
+    guint next_room;
+
+    guint64 stats_ticks;
+    guint64 stats_overruns;
+    gint64 stats_tick_time_total_us;
+    gint64 stats_tick_time_max_us;
+    gint64 stats_last_us;
+};
+
+/*
+ *
+ * PCM kernels.
+ *
+ */
+
+static void pcm_add_saturating_s16(gint16 *dst, const gint16 *src, gsize samples) {
+    gsize i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= samples; i += 8) {
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+    }
+#endif
+
+    for (; i < samples; i++) {
+        gint32 sum = (gint32)dst[i] + src[i];
+        dst[i] = (gint16)CLAMP(sum, G_MININT16, G_MAXINT16);
+    }
+}
+
+static void pcm_apply_gain_s16(gint16 *dst, const gint16 *src, gsize samples, gint32 gain) {
+    gsize i = 0;
+
+#if defined(__SSE2__)
+    // Gains above 16 bits would not fit the 16-bit multiplier, those streams take the scalar path
+    if (gain <= G_MAXINT16) {
+        __m128i g = _mm_set1_epi16((gint16)gain);
+        for (; i + 8 <= samples; i += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i lo = _mm_mullo_epi16(x, g);
+            __m128i hi = _mm_mulhi_epi16(x, g);
+            __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), MIXER_GAIN_SHIFT);
+            __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), MIXER_GAIN_SHIFT);
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(p0, p1));
+        }
+    }
+#elif defined(__ARM_NEON)
+    if (gain <= G_MAXINT16) {
+        int16x4_t g = vdup_n_s16((gint16)gain);
+        for (; i + 8 <= samples; i += 8) {
+            int16x8_t x = vld1q_s16(src + i);
+            int16x4_t lo = vqshrn_n_s32(vmull_s16(vget_low_s16(x), g), MIXER_GAIN_SHIFT);
+            int16x4_t hi = vqshrn_n_s32(vmull_s16(vget_high_s16(x), g), MIXER_GAIN_SHIFT);
+            vst1q_s16(dst + i, vcombine_s16(lo, hi));
+        }
+    }
+#endif
+
+    for (; i < samples; i++) {
+        gint64 scaled = ((gint64)src[i] * gain) >> MIXER_GAIN_SHIFT;
+        dst[i] = (gint16)CLAMP(scaled, G_MININT16, G_MAXINT16);
+    }
+}
+
+/*
+ *
+ * Rooms and streams. Everything below runs with the mixer mutex held.
+ *
+ */
+
+static guint64 mixer_room_position_at(MixerRoom *room, gint64 time_us) {
+    gint64 elapsed_us = time_us - room->start_us;
+    if (elapsed_us <= 0) return 0;
+
+    return (guint64)elapsed_us * room->sample_rate / G_USEC_PER_SEC;
+}
+
+static MixerRoom *mixer_room_new(const gchar *name, gint32 sample_rate, guint8 channels) {
+    MixerRoom *room = g_new0(MixerRoom, 1);
+    room->name = g_ref_string_new(name);
+    room->sample_rate = sample_rate;
+    room->channels = channels;
+    room->start_us = g_get_monotonic_time();
+    room->streams = g_ptr_array_new();
+
+    room->tick_frames = (guint)((gint64)sample_rate * MIXER_TICK_MS / 1000);
+    room->mix_buffer = g_new(gint16, (gsize)room->tick_frames * channels);
+    room->scratch_buffer = g_new(gint16, (gsize)room->tick_frames * channels);
+
+    return room;
+}
+
+static void mixer_room_free(gpointer data) {
+    MixerRoom *room = data;
+
+    g_ptr_array_unref(room->streams);
+    g_free(room->mix_buffer);
+    g_free(room->scratch_buffer);
+    g_ref_string_release(room->name);
+    g_free(room);
+}
+
+static void mixer_stream_free(gpointer data) {
+    MixerStream *stream = data;
+
+    g_free(stream->ring);
+    g_free(stream);
+}
+
+static void mixer_detach_stream(Mixer *mixer, MixerStream *stream) {
+    MixerRoom *room = stream->room;
+
+    g_ptr_array_remove_fast(room->streams, stream);
+    g_hash_table_remove(mixer->streams, stream->id);
+
+    if (room->streams->len == 0) {
+        ALOGD("Mixer room %s is empty, removing", room->name);
+
+        g_ptr_array_remove(mixer->room_order, room);
+        g_hash_table_remove(mixer->rooms, room->name);
+    }
+}
+
+static void mixer_output_free(gpointer data) {
+    MixerOutput *output = data;
+
+    if (g_atomic_int_dec_and_test(&output->sink->ref_count)) {
+        g_free(output->sink);
+    }
+    g_ref_string_release(output->room);
+    g_bytes_unref(output->pcm);
+    buffer_pool_release(output);
+}
+
+static gboolean mixer_output_dispatch(gpointer data) {
+    MixerOutput *output = data;
+
+    if (output->sink->alive) {
+        output->sink->output_func(output->room, output->pcm, output->sink->user_data);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void mixer_post_output(Mixer *mixer, MixerRoom *room, gsize size) {
+    MixerOutput *output = buffer_pool_alloc(sizeof(MixerOutput));
+    output->sink = mixer->sink;
+    g_atomic_int_inc(&output->sink->ref_count);
+    output->room = g_ref_string_acquire(room->name);
+    output->pcm = buffer_pool_new_bytes(room->mix_buffer, size);
+
+    // Not g_main_context_invoke(), which runs the callback right here if this thread can acquire the context, e.g.
+    // while the main loop isn't running
+    GSource *source = g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_DEFAULT);
+    g_source_set_callback(source, mixer_output_dispatch, output, mixer_output_free);
+    g_source_attach(source, mixer->context);
+    g_source_unref(source);
+}
+
+/// Mixes one tick of the room timeline starting at mixed_pos.
+static void mixer_room_mix_tick(Mixer *mixer, MixerRoom *room) {
+    guint channels = room->channels;
+    guint64 block_start = room->mixed_pos;
+    guint64 block_end = block_start + room->tick_frames;
+
+    memset(room->mix_buffer, 0, room->tick_frames * channels * sizeof(gint16));
+
+    for (guint i = 0; i < room->streams->len; i++) {
+        MixerStream *stream = g_ptr_array_index(room->streams, i);
+
+        guint64 pos = MAX(block_start, stream->read_pos);
+        guint64 end = MIN(block_end, stream->write_pos);
+
+        while (pos < end) {
+            guint64 ring_index = pos % stream->capacity_frames;
+            guint64 frames = MIN(end - pos, stream->capacity_frames - ring_index);
+
+            gint16 *dst = room->mix_buffer + (pos - block_start) * channels;
+            const gint16 *src = stream->ring + ring_index * channels;
+            gsize samples = frames * channels;
+
+            if (stream->gain == MIXER_GAIN_UNITY) {
+                pcm_add_saturating_s16(dst, src, samples);
+            } else {
+                pcm_apply_gain_s16(room->scratch_buffer, src, samples, stream->gain);
+                pcm_add_saturating_s16(dst, room->scratch_buffer, samples);
+            }
+
+            pos += frames;
+        }
+
+        stream->read_pos = MAX(stream->read_pos, MIN(block_end, stream->write_pos));
+    }
+
+    room->mixed_pos = block_end;
+
+    mixer_post_output(mixer, room, room->tick_frames * channels * sizeof(gint16));
+
+    // Ended streams leave once drained, iterate backwards as removal swaps in the last element
+    for (guint i = room->streams->len; i-- > 0;) {
+        MixerStream *stream = g_ptr_array_index(room->streams, i);
+
+        if (stream->ended && stream->read_pos >= stream->write_pos) {
+            ALOGD("Mixer stream %p drained", stream->id);
+            mixer_detach_stream(mixer, stream);
+        }
+    }
+}
+
+static void mixer_tick(Mixer *mixer) {
+    gint64 tick_start_us = g_get_monotonic_time();
+    guint room_count = mixer->room_order->len;
+    guint served = 0;
+
+    while (served < room_count) {
+        if (g_get_monotonic_time() - tick_start_us > MIXER_TICK_BUDGET_US) {
+            mixer->stats_overruns++;
+            break;
+        }
+
+        // Rooms may be removed while mixing, the cursor is revalidated every iteration
+        if (mixer->room_order->len == 0) break;
+        mixer->next_room %= mixer->room_order->len;
+
+        MixerRoom *room = g_ptr_array_index(mixer->room_order, mixer->next_room);
+        guint64 target_pos = mixer_room_position_at(room, tick_start_us - MIXER_PLAYOUT_DELAY_MS * 1000);
+
+        if (target_pos > room->mixed_pos + MIXER_MAX_CATCH_UP_TICKS * room->tick_frames) {
+            ALOGW("Mixer room %s is behind by %" G_GUINT64_FORMAT " frames, skipping ahead",
+                  room->name,
+                  target_pos - room->mixed_pos);
+            room->mixed_pos = target_pos - room->tick_frames;
+        }
+
+        guint room_len_before = mixer->room_order->len;
+
+        while (room->mixed_pos + room->tick_frames <= target_pos) {
+            mixer_room_mix_tick(mixer, room);
+
+            // The last stream drained and took the room with it
+            if (mixer->room_order->len != room_len_before) break;
+        }
+
+        if (mixer->room_order->len == room_len_before) {
+            mixer->next_room++;
+        }
+        served++;
+    }
+
+    gint64 tick_time_us = g_get_monotonic_time() - tick_start_us;
+    mixer->stats_ticks++;
+    mixer->stats_tick_time_total_us += tick_time_us;
+    mixer->stats_tick_time_max_us = MAX(mixer->stats_tick_time_max_us, tick_time_us);
+
+    if (tick_start_us - mixer->stats_last_us >= MIXER_STATS_INTERVAL_US) {
+        if (room_count > 0) {
+            ALOGI("Mixer: %u rooms, %u streams, tick avg %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT
+                  " us, %" G_GUINT64_FORMAT " budget overruns",
+                  room_count,
+                  g_hash_table_size(mixer->streams),
+                  mixer->stats_tick_time_total_us / (gint64)mixer->stats_ticks,
+                  mixer->stats_tick_time_max_us,
+                  mixer->stats_overruns);
+        }
+
+        mixer->stats_ticks = 0;
+        mixer->stats_overruns = 0;
+        mixer->stats_tick_time_total_us = 0;
+        mixer->stats_tick_time_max_us = 0;
+        mixer->stats_last_us = tick_start_us;
+    }
+}
+
+static gpointer mixer_thread_func(gpointer data) {
+    Mixer *mixer = data;
+    gint64 next_tick_us = g_get_monotonic_time();
+
+    g_mutex_lock(&mixer->mutex);
+
+    while (mixer->running) {
+        next_tick_us += MIXER_TICK_MS * 1000;
+
+        // Returns FALSE once the deadline passes, TRUE on wakeups from mixer_free()
+        while (mixer->running && g_cond_wait_until(&mixer->cond, &mixer->mutex, next_tick_us)) {
+        }
+        if (!mixer->running) break;
+
+        mixer_tick(mixer);
+
+        // Don't try to make up for ticks lost to scheduling, rooms catch up on their own
+        gint64 now_us = g_get_monotonic_time();
+        if (now_us > next_tick_us + MIXER_TICK_MS * 1000) {
+            next_tick_us = now_us;
+        }
+    }
+
+    g_mutex_unlock(&mixer->mutex);
+
+    return NULL;
+}
+
+/*
+ *
+ * Public API.
+ *
+ */
+
+Mixer *mixer_new(GMainContext *context, MixerOutputFunc output_func, gpointer user_data) {
+    Mixer *mixer = g_new0(Mixer, 1);
+
+    mixer->context = context ? g_main_context_ref(context) : g_main_context_ref_thread_default();
+
+    mixer->sink = g_new0(MixerSink, 1);
+    mixer->sink->ref_count = 1;
+    mixer->sink->alive = TRUE;
+    mixer->sink->output_func = output_func;
+    mixer->sink->user_data = user_data;
+
+    g_mutex_init(&mixer->mutex);
+    g_cond_init(&mixer->cond);
+
+    mixer->rooms = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, mixer_room_free);
+    mixer->streams = g_hash_table_new_full(NULL, NULL, NULL, mixer_stream_free);
+    mixer->room_order = g_ptr_array_new();
+    mixer->stats_last_us = g_get_monotonic_time();
+
+    mixer->running = TRUE;
+    mixer->thread = g_thread_new("mixer", mixer_thread_func, mixer);
+
+    return mixer;
+}
+
+/// Must be called on the main context passed to mixer_new().
+void mixer_free(Mixer *mixer) {
+    g_mutex_lock(&mixer->mutex);
+    mixer->running = FALSE;
+    g_cond_signal(&mixer->cond);
+    g_mutex_unlock(&mixer->mutex);
+
+    g_thread_join(mixer->thread);
+
+    // Outputs already queued on the main context are dropped
+    mixer->sink->alive = FALSE;
+    if (g_atomic_int_dec_and_test(&mixer->sink->ref_count)) {
+        g_free(mixer->sink);
+    }
+
+    g_ptr_array_unref(mixer->room_order);
+    g_hash_table_unref(mixer->streams);
+    g_hash_table_unref(mixer->rooms);
+
+    g_cond_clear(&mixer->cond);
+    g_mutex_clear(&mixer->mutex);
+    g_main_context_unref(mixer->context);
+    g_free(mixer);
+}
+
+gboolean mixer_add_stream(Mixer *mixer,
+                          gpointer stream_id,
+                          const gchar *room_name,
+                          gint32 sample_rate,
+                          guint8 channels,
+                          guint8 bits_per_sample,
+                          gdouble gain,
+                          GError **error) {
+    g_return_val_if_fail(room_name && *room_name, FALSE);
+
+    if (bits_per_sample != 16 || channels == 0 || channels > MIXER_MAX_CHANNELS ||
+        sample_rate < 1000 / MIXER_TICK_MS || sample_rate > MIXER_MAX_SAMPLE_RATE) {
+        g_set_error(error,
+                    G_IO_ERROR,
+                    G_IO_ERROR_NOT_SUPPORTED,
+                    "Unsupported PCM format: %d Hz, %u channels, %u bits",
+                    sample_rate,
+                    channels,
+                    bits_per_sample);
+        return FALSE;
+    }
+
+    gboolean added = FALSE;
+
+    g_mutex_lock(&mixer->mutex);
+
+    MixerRoom *room = g_hash_table_lookup(mixer->rooms, room_name);
+
+    if (g_hash_table_contains(mixer->streams, stream_id)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "Stream already joined a room");
+    } else if (room && (room->sample_rate != sample_rate || room->channels != channels)) {
+        g_set_error(error,
+                    G_IO_ERROR,
+                    G_IO_ERROR_NOT_SUPPORTED,
+                    "Room %s mixes %d Hz, %u channels",
+                    room_name,
+                    room->sample_rate,
+                    room->channels);
+    } else if (room && room->streams->len >= MIXER_MAX_STREAMS_PER_ROOM) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Room %s is full", room_name);
+    } else {
+        if (!room) {
+            room = mixer_room_new(room_name, sample_rate, channels);
+            g_hash_table_insert(mixer->rooms, room->name, room);
+            g_ptr_array_add(mixer->room_order, room);
+        }
+
+        MixerStream *stream = g_new0(MixerStream, 1);
+        stream->id = stream_id;
+        stream->room = room;
+        stream->gain = (gint32)(CLAMP(gain, 0.0, 16.0) * MIXER_GAIN_UNITY + 0.5);
+        stream->capacity_frames = (guint64)sample_rate * MIXER_STREAM_BUFFER_MS / 1000;
+        stream->ring = g_new(gint16, stream->capacity_frames * channels);
+
+        g_ptr_array_add(room->streams, stream);
+        g_hash_table_insert(mixer->streams, stream_id, stream);
+        added = TRUE;
+
+        ALOGD("Mixer stream %p joined room %s (%u streams)", stream_id, room_name, room->streams->len);
+    }
+
+    g_mutex_unlock(&mixer->mutex);
+
+    return added;
+}
+
+void mixer_end_stream(Mixer *mixer, gpointer stream_id) {
+    g_mutex_lock(&mixer->mutex);
+
+    MixerStream *stream = g_hash_table_lookup(mixer->streams, stream_id);
+    if (stream) {
+        stream->ended = TRUE;
+    }
+
+    g_mutex_unlock(&mixer->mutex);
+}
+
+void mixer_remove_stream(Mixer *mixer, gpointer stream_id) {
+    g_mutex_lock(&mixer->mutex);
+
+    MixerStream *stream = g_hash_table_lookup(mixer->streams, stream_id);
+    if (stream) {
+        mixer_detach_stream(mixer, stream);
+    }
+
+    g_mutex_unlock(&mixer->mutex);
+}
+
+gboolean mixer_has_stream(Mixer *mixer, gpointer stream_id) {
+    g_mutex_lock(&mixer->mutex);
+    gboolean found = g_hash_table_contains(mixer->streams, stream_id);
+    g_mutex_unlock(&mixer->mutex);
+
+    return found;
+}
+
+void mixer_push(Mixer *mixer, gpointer stream_id, gint64 timestamp_us, gconstpointer pcm, gsize size) {
+    g_mutex_lock(&mixer->mutex);
+
+    MixerStream *stream = g_hash_table_lookup(mixer->streams, stream_id);
+    if (!stream || stream->ended) {
+        g_mutex_unlock(&mixer->mutex);
+        return;
+    }
+
+    MixerRoom *room = stream->room;
+    gsize frame_size = room->channels * sizeof(gint16);
+    guint64 frames = size / frame_size;
+
+    if (size % frame_size != 0) {
+        ALOGW("Mixer stream %p sent a partial frame, dropping %zu bytes", stream_id, size % frame_size);
+    }
+
+    // Late or first chunk, place it on the timeline by its timestamp
+    if (!stream->positioned || stream->write_pos < room->mixed_pos) {
+        guint64 pos = MAX(mixer_room_position_at(room, timestamp_us), room->mixed_pos);
+        stream->read_pos = pos;
+        stream->write_pos = pos;
+        stream->positioned = TRUE;
+    }
+
+    guint64 free_frames = stream->capacity_frames - (stream->write_pos - stream->read_pos);
+    if (frames > free_frames) {
+        ALOGW("Mixer stream %p overflows, dropping %" G_GUINT64_FORMAT " frames", stream_id, frames - free_frames);
+        frames = free_frames;
+    }
+
+    const gint16 *src = pcm;
+    guint64 written = 0;
+
+    while (written < frames) {
+        guint64 ring_index = stream->write_pos % stream->capacity_frames;
+        guint64 count = MIN(frames - written, stream->capacity_frames - ring_index);
+
+        memcpy(stream->ring + ring_index * room->channels, src + written * room->channels, count * frame_size);
+
+        written += count;
+        stream->write_pos += count;
+    }
+
+    g_mutex_unlock(&mixer->mutex);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Multi-stream audio mixer.
+ *
+ * Streams join a room with a 16-bit PCM format, their chunks are placed on the room timeline by timestamp and summed
+ * with per-stream gain on a dedicated worker thread. Each tick produces one mixed chunk per room, which is delivered
+ * on the GMainContext the mixer was created on.
+ */
+
+typedef struct _Mixer Mixer;
+
+/// Called on the owner's main context with one tick of mixed interleaved S16 PCM.
+typedef void (*MixerOutputFunc)(const gchar *room, GBytes *pcm, gpointer user_data);
+
+Mixer *mixer_new(GMainContext *context, MixerOutputFunc output_func, gpointer user_data);
+
+void mixer_free(Mixer *mixer);
+
+/// Gain is linear, 1.0 leaves the stream untouched.
+gboolean mixer_add_stream(Mixer *mixer,
+                          gpointer stream_id,
+                          const gchar *room,
+                          gint32 sample_rate,
+                          guint8 channels,
+                          guint8 bits_per_sample,
+                          gdouble gain,
+                          GError **error);
+
+/// The stream is dropped once all of its queued audio has been mixed.
+void mixer_end_stream(Mixer *mixer, gpointer stream_id);
+
+void mixer_remove_stream(Mixer *mixer, gpointer stream_id);
+
+gboolean mixer_has_stream(Mixer *mixer, gpointer stream_id);
+
+/// Queues interleaved S16 PCM. The timestamp is in g_get_monotonic_time() units and only places the first chunk of a
+/// stream on the room timeline, later chunks follow contiguously.
+void mixer_push(Mixer *mixer, gpointer stream_id, gint64 timestamp_us, gconstpointer pcm, gsize size);
@@ -0,0 +1,450 @@
+#include "processor.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../utils/buffer_pool.h"
+#include "../utils/logger.h"
+
+/// Queued messages per stream and in total, anything beyond is dropped
+#define PROCESSOR_STREAM_QUEUE_MAX 32
+#define PROCESSOR_TOTAL_QUEUE_MAX 1024
+
+/// A stream is backpressured from this queue depth until it drains down to the low watermark
+#define PROCESSOR_STREAM_QUEUE_HIGH 16
+#define PROCESSOR_STREAM_QUEUE_LOW 4
+
+/// Same, for the messages queued across all streams. Keeps a burst of streams from saturating the pool.
+#define PROCESSOR_TOTAL_QUEUE_HIGH 256
+#define PROCESSOR_TOTAL_QUEUE_LOW 64
+
+#define PROCESSOR_STATS_INTERVAL_US (10 * G_USEC_PER_SEC)
+
+/// Pooled, and queued through the embedded link, so that queueing a message doesn't allocate.
+typedef struct {
+    GList link;
+    GBytes *data;
+    /// Time of processor_push(), queue wait is measured from here
+    gint64 timestamp_us;
+    gpointer result;
+} ProcessorJob;
+
+typedef struct {
+    /// Lets dispatches on the main context find their way back
+    Processor *processor;
+    gpointer id;
+
+    GQueue pending;
+    /// Processed jobs waiting for the main context, in push order
+    GQueue completed;
+
+    /// The stream is queued in the pool or a worker is running one of its jobs. At most one job of a stream is in
+    /// flight, which is what keeps its messages in order.
+    gboolean scheduled;
+    gboolean dispatch_scheduled;
+    /// Idle source delivering the completed jobs, set while dispatch_scheduled
+    GSource *dispatch_source;
+    gboolean backpressured;
+    /// No longer in the streams table, freed once neither the pool nor a dispatch refers to it
+    gboolean removed;
+} ProcessorStream;
+
+struct _Processor {
+    GMainContext *context;
+    ProcessorFuncs funcs;
+    gpointer user_data;
+
+    GThreadPool *pool;
+
+    GMutex mutex;
+    /// Stream id -> ProcessorStream
+    GHashTable *streams;
+    /// Removed streams the pool or a dispatch still refers to
+    GHashTable *retired;
+
+    guint queued;
+    guint backpressured_streams;
+
+    guint64 stats_jobs;
+    guint64 stats_dropped;
+    guint64 stats_backpressure_events;
+    gint64 stats_wait_total_us;
+    gint64 stats_wait_max_us;
+    gint64 stats_process_total_us;
+    gint64 stats_process_max_us;
+    gint64 stats_last_us;
+};
+
+static void processor_job_free(Processor *processor, ProcessorJob *job) {
+    if (job->data) {
+        g_bytes_unref(job->data);
+    }
+    if (job->result && processor->funcs.result_free) {
+        processor->funcs.result_free(job->result);
+    }
+    buffer_pool_release(job);
+}
+
+static ProcessorJob *processor_queue_pop(GQueue *queue) {
+    GList *link = g_queue_pop_head_link(queue);
+    return link ? link->data : NULL;
+}
+
+static void processor_stream_free(Processor *processor, ProcessorStream *stream) {
+    ProcessorJob *job;
+
+    while ((job = processor_queue_pop(&stream->pending))) {
+        processor_job_free(processor, job);
+    }
+    while ((job = processor_queue_pop(&stream->completed))) {
+        processor_job_free(processor, job);
+    }
+
+    g_free(stream);
+}
+
+/// Takes the stream out of the streams table and drops its queued jobs. Returns TRUE if it can be freed right away.
+static gboolean processor_retire_stream_locked(Processor *processor, ProcessorStream *stream) {
+    stream->removed = TRUE;
+
+    if (stream->backpressured) {
+        stream->backpressured = FALSE;
+        processor->backpressured_streams--;
+    }
+
+    processor->queued -= g_queue_get_length(&stream->pending);
+
+    ProcessorJob *job;
+    while ((job = processor_queue_pop(&stream->pending))) {
+        processor_job_free(processor, job);
+    }
+
+    if (stream->scheduled || stream->dispatch_scheduled) {
+        g_hash_table_add(processor->retired, stream);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void processor_log_stats_locked(Processor *processor, gint64 now_us) {
+    if (now_us - processor->stats_last_us < PROCESSOR_STATS_INTERVAL_US) {
+        return;
+    }
+
+    if (processor->stats_jobs > 0 || processor->stats_dropped > 0) {
+        gint64 jobs = (gint64)MAX(processor->stats_jobs, 1);
+
+        ALOGI("Processor: %" G_GUINT64_FORMAT " jobs, %u queued, wait avg %" G_GINT64_FORMAT
+              " us, max %" G_GINT64_FORMAT " us, processing avg %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT
+              " us, %" G_GUINT64_FORMAT " dropped, %" G_GUINT64_FORMAT " backpressure events",
+              processor->stats_jobs,
+              processor->queued,
+              processor->stats_wait_total_us / jobs,
+              processor->stats_wait_max_us,
+              processor->stats_process_total_us / jobs,
+              processor->stats_process_max_us,
+              processor->stats_dropped,
+              processor->stats_backpressure_events);
+    }
+
+    processor->stats_jobs = 0;
+    processor->stats_dropped = 0;
+    processor->stats_backpressure_events = 0;
+    processor->stats_wait_total_us = 0;
+    processor->stats_wait_max_us = 0;
+    processor->stats_process_total_us = 0;
+    processor->stats_process_max_us = 0;
+    processor->stats_last_us = now_us;
+}
+
+/// Collects the streams that may resume, their ids are appended to resumed.
+static void processor_release_backpressure_locked(Processor *processor, GPtrArray *resumed) {
+    if (processor->backpressured_streams == 0 || processor->queued > PROCESSOR_TOTAL_QUEUE_LOW) {
+        return;
+    }
+
+    GHashTableIter iter;
+    ProcessorStream *stream;
+    g_hash_table_iter_init(&iter, processor->streams);
+
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stream)) {
+        if (stream->backpressured && g_queue_get_length(&stream->pending) <= PROCESSOR_STREAM_QUEUE_LOW) {
+            stream->backpressured = FALSE;
+            processor->backpressured_streams--;
+            g_ptr_array_add(resumed, stream->id);
+        }
+    }
+}
+
+static gboolean processor_dispatch(gpointer user_data) {
+    ProcessorStream *stream = user_data;
+    Processor *processor = stream->processor;
+    gpointer stream_id = stream->id;
+
+    GPtrArray *resumed = g_ptr_array_new();
+
+    g_mutex_lock(&processor->mutex);
+
+    // Take the whole batch, the callbacks run unlocked and may remove the stream
+    GQueue completed = stream->completed;
+    g_queue_init(&stream->completed);
+
+    stream->dispatch_scheduled = FALSE;
+    GSource *source = g_steal_pointer(&stream->dispatch_source);
+
+    gboolean removed = stream->removed;
+    gboolean release = removed && !stream->scheduled;
+
+    if (release) {
+        g_hash_table_remove(processor->retired, stream);
+    }
+
+    processor_release_backpressure_locked(processor, resumed);
+
+    g_mutex_unlock(&processor->mutex);
+
+    g_source_unref(source);
+
+    ProcessorJob *job;
+    while ((job = processor_queue_pop(&completed))) {
+        if (!removed) {
+            processor->funcs.done(stream_id, job->result, processor->user_data);
+        }
+        processor_job_free(processor, job);
+    }
+
+    if (processor->funcs.backpressure) {
+        for (guint i = 0; i < resumed->len; i++) {
+            processor->funcs.backpressure(g_ptr_array_index(resumed, i), FALSE, processor->user_data);
+        }
+    }
+
+    g_ptr_array_free(resumed, TRUE);
+
+    if (release) {
+        processor_stream_free(processor, stream);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void processor_worker(gpointer data, gpointer user_data) {
+    ProcessorStream *stream = data;
+    Processor *processor = user_data;
+
+    g_mutex_lock(&processor->mutex);
+    ProcessorJob *job = processor_queue_pop(&stream->pending);
+    if (job) {
+        processor->queued--;
+    }
+    g_mutex_unlock(&processor->mutex);
+
+    gint64 started_us = g_get_monotonic_time();
+    gint64 finished_us = started_us;
+
+    if (job) {
+        job->result = processor->funcs.work(stream->id, job->data, job->timestamp_us, processor->user_data);
+        finished_us = g_get_monotonic_time();
+
+        g_clear_pointer(&job->data, g_bytes_unref);
+    }
+
+    g_mutex_lock(&processor->mutex);
+
+    GSource *dispatch_source = NULL;
+
+    if (job) {
+        gint64 wait_us = started_us - job->timestamp_us;
+        gint64 process_us = finished_us - started_us;
+
+        processor->stats_jobs++;
+        processor->stats_wait_total_us += wait_us;
+        processor->stats_wait_max_us = MAX(processor->stats_wait_max_us, wait_us);
+        processor->stats_process_total_us += process_us;
+        processor->stats_process_max_us = MAX(processor->stats_process_max_us, process_us);
+
+        if (stream->removed) {
+            processor_job_free(processor, job);
+        } else {
+            g_queue_push_tail_link(&stream->completed, &job->link);
+
+            // One dispatch delivers everything completed until it runs
+            if (!stream->dispatch_scheduled) {
+                stream->dispatch_scheduled = TRUE;
+
+                dispatch_source = g_idle_source_new();
+                g_source_set_priority(dispatch_source, G_PRIORITY_DEFAULT);
+                g_source_set_callback(dispatch_source, processor_dispatch, stream, NULL);
+                stream->dispatch_source = dispatch_source;
+            }
+        }
+    }
+
+    // Requeue at the back rather than looping here, so that a busy stream doesn't hold a thread others are waiting for
+    if (!stream->removed && !g_queue_is_empty(&stream->pending)) {
+        g_thread_pool_push(processor->pool, stream, NULL);
+    } else {
+        stream->scheduled = FALSE;
+    }
+
+    gboolean release = stream->removed && !stream->scheduled && !stream->dispatch_scheduled;
+    if (release) {
+        g_hash_table_remove(processor->retired, stream);
+    }
+
+    processor_log_stats_locked(processor, finished_us);
+
+    g_mutex_unlock(&processor->mutex);
+
+    // Attached unlocked, as the dispatch takes the mutex. The stream can't go away before it ran or was destroyed.
+    if (dispatch_source) {
+        g_source_attach(dispatch_source, processor->context);
+    }
+
+    if (release) {
+        processor_stream_free(processor, stream);
+    }
+}
+
+Processor *processor_new(GMainContext *context, guint max_threads, const ProcessorFuncs *funcs, gpointer user_data) {
+    Processor *processor = g_new0(Processor, 1);
+
+    processor->context = context ? g_main_context_ref(context) : g_main_context_ref_thread_default();
+    processor->funcs = *funcs;
+    processor->user_data = user_data;
+
+    g_mutex_init(&processor->mutex);
+    processor->streams = g_hash_table_new(NULL, NULL);
+    processor->retired = g_hash_table_new(NULL, NULL);
+    processor->stats_last_us = g_get_monotonic_time();
+
+    if (max_threads == 0) {
+        max_threads = g_get_num_processors();
+    }
+
+    processor->pool = g_thread_pool_new(processor_worker, processor, (gint)max_threads, FALSE, NULL);
+
+    ALOGI("Processor started with up to %u threads", max_threads);
+
+    return processor;
+}
+
+void processor_free(Processor *processor) {
+    GPtrArray *released = g_ptr_array_new();
+
+    g_mutex_lock(&processor->mutex);
+
+    GHashTableIter iter;
+    ProcessorStream *stream;
+    g_hash_table_iter_init(&iter, processor->streams);
+
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stream)) {
+        if (processor_retire_stream_locked(processor, stream)) {
+            g_ptr_array_add(released, stream);
+        }
+    }
+    g_hash_table_remove_all(processor->streams);
+
+    g_mutex_unlock(&processor->mutex);
+
+    for (guint i = 0; i < released->len; i++) {
+        processor_stream_free(processor, g_ptr_array_index(released, i));
+    }
+    g_ptr_array_free(released, TRUE);
+
+    // Waits for the jobs already running, streams still queued in the pool are not run again
+    g_thread_pool_free(processor->pool, TRUE, TRUE);
+
+    // What is left was dropped from the pool queue or waits for a dispatch. The dispatches would only release their
+    // streams by now, destroying them rather than iterating the context keeps other sources from running in here.
+    g_hash_table_iter_init(&iter, processor->retired);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&stream, NULL)) {
+        if (stream->dispatch_source) {
+            g_source_destroy(stream->dispatch_source);
+            g_source_unref(stream->dispatch_source);
+        }
+        processor_stream_free(processor, stream);
+    }
+
+    g_hash_table_unref(processor->retired);
+    g_hash_table_unref(processor->streams);
+    g_mutex_clear(&processor->mutex);
+    g_main_context_unref(processor->context);
+
+    g_free(processor);
+}
+
+gboolean processor_push(Processor *processor, gpointer stream_id, GBytes *data) {
+    g_mutex_lock(&processor->mutex);
+
+    ProcessorStream *stream = g_hash_table_lookup(processor->streams, stream_id);
+
+    if (!stream) {
+        stream = g_new0(ProcessorStream, 1);
+        stream->processor = processor;
+        stream->id = stream_id;
+        g_queue_init(&stream->pending);
+        g_queue_init(&stream->completed);
+
+        g_hash_table_insert(processor->streams, stream_id, stream);
+    }
+
+    guint depth = g_queue_get_length(&stream->pending);
+
+    if (depth >= PROCESSOR_STREAM_QUEUE_MAX || processor->queued >= PROCESSOR_TOTAL_QUEUE_MAX) {
+        processor->stats_dropped++;
+        g_mutex_unlock(&processor->mutex);
+        return FALSE;
+    }
+
+    ProcessorJob *job = buffer_pool_alloc(sizeof(ProcessorJob));
+    memset(job, 0, sizeof(*job));
+    job->link.data = job;
+    job->data = data ? g_bytes_ref(data) : NULL;
+    job->timestamp_us = g_get_monotonic_time();
+
+    g_queue_push_tail_link(&stream->pending, &job->link);
+    processor->queued++;
+
+    gboolean paused = FALSE;
+
+    if (!stream->backpressured &&
+        (depth + 1 >= PROCESSOR_STREAM_QUEUE_HIGH || processor->queued >= PROCESSOR_TOTAL_QUEUE_HIGH)) {
+        stream->backpressured = TRUE;
+        processor->backpressured_streams++;
+        processor->stats_backpressure_events++;
+        paused = TRUE;
+    }
+
+    if (!stream->scheduled) {
+        stream->scheduled = TRUE;
+        g_thread_pool_push(processor->pool, stream, NULL);
+    }
+
+    g_mutex_unlock(&processor->mutex);
+
+    if (paused && processor->funcs.backpressure) {
+        processor->funcs.backpressure(stream_id, TRUE, processor->user_data);
+    }
+
+    return TRUE;
+}
+
+void processor_remove_stream(Processor *processor, gpointer stream_id) {
+    g_mutex_lock(&processor->mutex);
+
+    ProcessorStream *stream = g_hash_table_lookup(processor->streams, stream_id);
+    gboolean release = FALSE;
+
+    if (stream) {
+        g_hash_table_remove(processor->streams, stream_id);
+        release = processor_retire_stream_locked(processor, stream);
+    }
+
+    g_mutex_unlock(&processor->mutex);
+
+    if (release) {
+        processor_stream_free(processor, stream);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Per-stream message processing on a bounded thread pool.
+ *
+ * Messages of one stream are processed one at a time in arrival order, different streams run in parallel. Results are
+ * delivered in order on the GMainContext the processor was created on. A stream with too many queued messages is
+ * reported as backpressured, and messages beyond a hard limit are dropped.
+ */
+
+typedef struct _Processor Processor;
+
+/// Runs on a worker thread. The timestamp is the arrival time of the message.
+typedef gpointer (*ProcessorWorkFunc)(gpointer stream_id, GBytes *data, gint64 timestamp_us, gpointer user_data);
+
+/// Runs on the owner's main context, in the order the messages of the stream were pushed.
+typedef void (*ProcessorDoneFunc)(gpointer stream_id, gpointer result, gpointer user_data);
+
+/// Runs on the owner's main context when a stream starts or stops being backpressured.
+typedef void (*ProcessorBackpressureFunc)(gpointer stream_id, gboolean paused, gpointer user_data);
+
+typedef struct {
+    ProcessorWorkFunc work;
+    ProcessorDoneFunc done;
+    ProcessorBackpressureFunc backpressure;
+    GDestroyNotify result_free;
+} ProcessorFuncs;
+
+/// max_threads of 0 uses one thread per processor core.
+Processor *processor_new(GMainContext *context, guint max_threads, const ProcessorFuncs *funcs, gpointer user_data);
+
+/// Must be called on the owner's main context. Pending results are dropped without running the done callback.
+void processor_free(Processor *processor);
+
+/// Queues a message for processing. Returns FALSE if the stream is over its limit and the message was dropped.
+/// Data may be NULL for a marker that is handed to the work function in order with the messages around it.
+gboolean processor_push(Processor *processor, gpointer stream_id, GBytes *data);
+
+/// Drops the queued messages of the stream, results still in flight are discarded.
+void processor_remove_stream(Processor *processor, gpointer stream_id);
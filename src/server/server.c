@@ -1,10 +1,23 @@
+#ifdef __linux__
+    // accept4()
+    #define _GNU_SOURCE
+#endif
+
 #include "server.h"
 
+#ifdef __linux__
+    #include <errno.h>
+    #include <glib-unix.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+#endif
 #include <glib/gstdio.h>
 #include <json-glib/json-glib.h>
 #include <libsoup/soup-message.h>
 #include <libsoup/soup-server.h>
 #include <libsoup/soup-version.h>
+#include <math.h>
+#include <string.h>
 
 #if SOUP_CHECK_VERSION(3, 0, 0)
 
@@ -12,11 +25,22 @@
 
 #endif
 
-#include "../utils/logger.h"
+#include "../utils/arena.h"
 #include "../utils/audio_loader.h"
+#include "../utils/buffer_pool.h"
+#include "../utils/logger.h"
+#include "../utils/shm_ring.h"
+#include "../utils/trace.h"
+#include "control_message.h"
+#include "mixer.h"
+#include "processor.h"
 
 #define DEFAULT_PORT 8080
 
+#define DEFAULT_ROOM "default"
+
+#define STATS_INTERVAL_S 10
+
 struct _Server {
     GObject parent;
 
@@ -24,10 +48,46 @@ struct _Server {
 
     GSList *websocket_connections;
 
-    char *audio_buffer;
-    int audio_buffer_size;
+    /// Mapped WAV data
+    GBytes *audio_buffer;
+
+    TraceWriter *trace_writer;
+    guint32 next_stream_id;
+
+    Mixer *mixer;
+    /// Runs the mixer input path off the main loop
+    Processor *processor;
+
+    gchar *shm_socket_path;
+    int shm_listener_fd;
+    guint shm_listener_source_id;
+    /// Accepted producer connections waiting for their handshake, fd -> source id
+    GHashTable *shm_handshakes;
+
+    /// Scratch memory of the message being handled, reset after each message
+    Arena *arena;
+
+    guint stats_source_id;
+    guint64 stats_messages;
+    BufferPoolStats stats_last_pool;
 };
 
+/// Shared memory ring attached to a websocket connection, carries the connection's binary frames. Each frame is tagged
+/// with the number of websocket messages the client had sent before it, and waits until those have been handled.
+typedef struct {
+    Server *server;
+    SoupWebsocketConnection *connection;
+    ShmRing *ring;
+    guint source_id;
+} ServerShmChannel;
+
+/// Result of processing one binary message of a stream.
+typedef struct {
+    GBytes *pcm;
+    gdouble peak_dbfs;
+    gdouble rms_dbfs;
+} ServerChunkLevels;
+
 G_DEFINE_TYPE(Server, server, G_TYPE_OBJECT)
 
 enum {
@@ -47,12 +107,48 @@ Server *server_new() {
     guint8 channels;
     gint32 sampleRate;
     guint8 bitsPerSample;
-    server->audio_buffer = load_wav_c("test_audio.wav", &channels, &sampleRate, &bitsPerSample, &server->audio_buffer_size);
+    server->audio_buffer = load_wav_bytes_c("test_audio.wav", &channels, &sampleRate, &bitsPerSample);
     g_assert(server->audio_buffer);
 
     return server;
 }
 
+gboolean server_start_capture(Server *server, const char *path, GError **error) {
+    g_return_val_if_fail(!server->trace_writer, FALSE);
+
+    server->trace_writer = trace_writer_open(path, TRACE_ROLE_SERVER, error);
+    if (!server->trace_writer) {
+        return FALSE;
+    }
+
+    ALOGI("Capturing websocket frames to %s", path);
+
+    return TRUE;
+}
+
+static guint32 connection_stream_id(SoupWebsocketConnection *connection) {
+    return GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(connection), "stream_id"));
+}
+
+static void server_send_text(Server *server, SoupWebsocketConnection *connection, const gchar *text) {
+    trace_writer_record(server->trace_writer,
+                        connection_stream_id(connection),
+                        TRACE_DIRECTION_OUT,
+                        TRACE_FRAME_TEXT,
+                        text,
+                        strlen(text));
+
+    soup_websocket_connection_send_text(connection, text);
+}
+
+/// The same GBytes can go to any number of connections, libsoup copies it into each frame.
+static void server_send_binary(Server *server, SoupWebsocketConnection *connection, GBytes *bytes) {
+    trace_writer_record_bytes(
+        server->trace_writer, connection_stream_id(connection), TRACE_DIRECTION_OUT, TRACE_FRAME_BINARY, bytes);
+
+    soup_websocket_connection_send_message(connection, SOUP_WEBSOCKET_DATA_BINARY, bytes);
+}
+
 #if !SOUP_CHECK_VERSION(3, 0, 0)
 static void http_cb(SoupServer *server,
                     SoupMessage *msg,
@@ -80,61 +176,352 @@ static void http_cb(SoupServer *server,     //
 
 #endif
 
-static void server_handle_json_message(Server *server, SoupWebsocketConnection *connection, GBytes *message) {
-    gsize length = 0;
-    const gchar *msg_data = g_bytes_get_data(message, &length);
+/// Returns NULL unless the member exists and holds a string, clients may send anything.
+static const gchar *json_object_get_string_or_null(JsonObject *object, const gchar *member) {
+    JsonNode *node = json_object_get_member(object, member);
+
+    if (!node || !JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_STRING) {
+        return NULL;
+    }
+
+    return json_node_get_string(node);
+}
+
+/// The room a message names, DEFAULT_ROOM if it names none, or NULL if the member isn't a non-empty string.
+static const gchar *server_get_message_room(SoupWebsocketConnection *connection, JsonObject *msg) {
+    if (!json_object_has_member(msg, "room")) return DEFAULT_ROOM;
+
+    const gchar *room = json_object_get_string_or_null(msg, "room");
+    if (!room || !*room) {
+        ALOGW("Client %p sent an invalid room", connection);
+        return NULL;
+    }
+
+    return room;
+}
+
+/// Clamps an integer member so that narrowing it can't wrap an out-of-range value into a valid one. A missing member
+/// reads as 0, which the mixer rejects like any other unsupported format.
+static gint64 json_object_get_int_clamped(JsonObject *object, const gchar *member, gint64 max) {
+    return CLAMP(control_message_get_int(object, member, 0), 0, max);
+}
+
+static void server_send_pong(Server *server, SoupWebsocketConnection *connection, JsonObject *ping) {
+    server_send_text(server, connection, control_message_format_pong(server->arena, ping));
+}
+
+/// A connection receives the mixed stream of the room it joined with a join message. Sending audio into a room doesn't
+/// join it, there is no mix-minus and a sender would get its own audio back.
+static void server_join_room(SoupWebsocketConnection *connection, const gchar *room) {
+    ALOGD("Client %p joined room %s", connection, room);
+
+    g_object_set_data_full(G_OBJECT(connection), "room", g_strdup(room), g_free);
+}
+
+static void server_handle_pcm_descriptor(Server *server, SoupWebsocketConnection *connection, JsonObject *msg) {
+    if (control_message_get_boolean(msg, "eos", FALSE)) {
+        ALOGD("Client %p reached EOS", connection);
+
+        // Ends the stream after the chunks still being processed
+        if (!processor_push(server->processor, connection, NULL)) {
+            mixer_end_stream(server->mixer, connection);
+        }
+        return;
+    }
+
+    const gchar *room = server_get_message_room(connection, msg);
+    if (!room) return;
+
+    gdouble gain = control_message_get_double(msg, "gain", 1.0);
+
+    GError *error = NULL;
+
+    if (!mixer_add_stream(server->mixer,
+                          connection,
+                          room,
+                          (gint32)json_object_get_int_clamped(msg, "sampleRate", G_MAXINT32),
+                          (guint8)json_object_get_int_clamped(msg, "channels", G_MAXUINT8),
+                          (guint8)json_object_get_int_clamped(msg, "bitsPerSample", G_MAXUINT8),
+                          gain,
+                          &error)) {
+        ALOGE("Client %p can't join the mixer: %s", connection, error->message);
+        g_clear_error(&error);
+    }
+}
+
+static void server_mixer_output_cb(const gchar *room, GBytes *pcm, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+
+    for (GSList *iter = server->websocket_connections; iter; iter = iter->next) {
+        SoupWebsocketConnection *connection = iter->data;
 
-    JsonParser *parser = json_parser_new();
+        const gchar *connection_room = g_object_get_data(G_OBJECT(connection), "room");
+        if (!connection_room || !g_str_equal(connection_room, room)) continue;
+
+        if (soup_websocket_connection_get_state(connection) == SOUP_WEBSOCKET_STATE_OPEN) {
+            server_send_binary(server, connection, pcm);
+        }
+    }
+}
+
+/// Returns TRUE if the message was a recognized JSON control message.
+static gboolean server_handle_json_message(Server *server, SoupWebsocketConnection *connection, GBytes *message) {
+    // Reused across messages, loading drops the previous tree
+    JsonParser *parser = g_object_get_data(G_OBJECT(connection), "json_parser");
     GError *error = NULL;
+    gboolean handled = FALSE;
 
-    if (json_parser_load_from_data(parser, msg_data, length, &error)) {
-        JsonObject *msg = json_node_get_object(json_parser_get_root(parser));
+    JsonObject *msg = control_message_parse(parser, message, &error);
 
-        if (!json_object_has_member(msg, "msg")) {
+    if (msg) {
+        // Older clients send the PCM descriptor without a message type
+        if (!json_object_has_member(msg, "msg") && json_object_has_member(msg, "sampleRate")) {
+            server_handle_pcm_descriptor(server, connection, msg);
+            handled = TRUE;
+            goto out;
+        }
+
+        const gchar *msg_type = json_object_get_string_or_null(msg, "msg");
+        if (!msg_type) {
             // Invalid message
             goto out;
         }
 
-        const gchar *msg_type = json_object_get_string_member(msg, "msg");
         if (g_str_equal(msg_type, "answer")) {
-            const gchar *answer_sdp = json_object_get_string_member(msg, "sdp");
+            const gchar *answer_sdp = json_object_get_string_or_null(msg, "sdp");
             // ALOGD("Received answer:\n %s", answer_sdp);
 
-            g_signal_emit(server, signals[SIGNAL_DATA_CHUNK_DESCRIPTOR], 0, connection, answer_sdp);
+            if (answer_sdp) {
+                g_signal_emit(server, signals[SIGNAL_DATA_CHUNK_DESCRIPTOR], 0, connection, answer_sdp);
+            }
+            handled = TRUE;
+        } else if (g_str_equal(msg_type, "ping")) {
+            server_send_pong(server, connection, msg);
+            handled = TRUE;
+        } else if (g_str_equal(msg_type, "descriptor")) {
+            server_handle_pcm_descriptor(server, connection, msg);
+            handled = TRUE;
+        } else if (g_str_equal(msg_type, "join")) {
+            const gchar *room = server_get_message_room(connection, msg);
+            if (room) {
+                server_join_room(connection, room);
+            }
+            handled = TRUE;
         }
-    } else {
+    } else if (error) {
         ALOGD("Error parsing message: %s", error->message);
         g_clear_error(&error);
     }
 
 out:
-    g_object_unref(parser);
+    return handled;
 }
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
+static const char test_data_buf[] = "This is some test binary data";
+
+static gdouble server_level_to_dbfs(gdouble level) {
+    return level > 0 ? 20.0 * log10(level / G_MAXINT16) : -INFINITY;
+}
+
+/// Runs on a processor thread. Measures the chunk levels and feeds the chunk to the mixer.
+static gpointer server_process_chunk(gpointer stream_id, GBytes *data, gint64 timestamp_us, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+
+    if (!data) {
+        mixer_end_stream(server->mixer, stream_id);
+        return NULL;
+    }
+
+    gsize size = 0;
+    const gint16 *samples = g_bytes_get_data(data, &size);
+    gsize sample_count = size / sizeof(gint16);
+
+    gint32 peak = 0;
+    gdouble sum_squares = 0;
+
+    for (gsize i = 0; i < sample_count; i++) {
+        gint32 sample = ABS((gint32)samples[i]);
+        peak = MAX(peak, sample);
+        sum_squares += (gdouble)sample * sample;
+    }
+
+    mixer_push(server->mixer, stream_id, timestamp_us, samples, size);
+
+    ServerChunkLevels *levels = buffer_pool_alloc(sizeof(ServerChunkLevels));
+    levels->pcm = g_bytes_ref(data);
+    levels->peak_dbfs = server_level_to_dbfs(peak);
+    levels->rms_dbfs = server_level_to_dbfs(sample_count > 0 ? sqrt(sum_squares / (gdouble)sample_count) : 0);
+
+    return levels;
+}
+
+static void server_chunk_levels_free(gpointer data) {
+    ServerChunkLevels *levels = data;
+
+    g_bytes_unref(levels->pcm);
+    buffer_pool_release(levels);
+}
+
+/// Back on the main context, in the order the chunks of the client arrived.
+static void server_chunk_processed_cb(gpointer stream_id, gpointer result, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+    ServerChunkLevels *levels = result;
+
+    if (!levels) return;
+
+    ALOGD("Client %p chunk of %zu bytes, peak %.1f dBFS, RMS %.1f dBFS",
+          stream_id,
+          g_bytes_get_size(levels->pcm),
+          levels->peak_dbfs,
+          levels->rms_dbfs);
+
+    g_signal_emit(server, signals[SIGNAL_DATA_CHUNK], 0, stream_id, levels->pcm);
+}
+
+/// Asks the client to hold off sending audio while its chunks are queued up in the processor.
+static void server_backpressure_cb(gpointer stream_id, gboolean paused, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+    SoupWebsocketConnection *connection = stream_id;
+
+    if (!g_slist_find(server->websocket_connections, connection) ||
+        soup_websocket_connection_get_state(connection) != SOUP_WEBSOCKET_STATE_OPEN) {
+        return;
+    }
+
+    ALOGD("Client %p %s", connection, paused ? "is backpressured" : "may resume sending");
+
+    server_send_text(server,
+                     connection,
+                     paused ? "{\"msg\":\"backpressure\",\"paused\":true}"
+                            : "{\"msg\":\"backpressure\",\"paused\":false}");
+}
+
+static void server_handle_binary_message(Server *server, SoupWebsocketConnection *connection, GBytes *message) {
+    if (!mixer_has_stream(server->mixer, connection)) {
+        ALOGD("Received binary message from client %p without a PCM descriptor, ignoring", connection);
+        return;
+    }
+
+    if (!processor_push(server->processor, connection, message)) {
+        ALOGW("Client %p is too far ahead of processing, dropping %zu bytes", connection, g_bytes_get_size(message));
+    }
+}
+
+static gboolean server_shm_message_cb(guint32 sequence, gconstpointer data, gsize size, gpointer user_data) {
+    ServerShmChannel *channel = user_data;
+
+    // The ring can overtake a websocket message sent before this frame, such as the PCM descriptor
+    guint32 handled = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(channel->connection), "websocket_messages"));
+    if ((gint32)(sequence - handled) > 0) {
+        return FALSE;
+    }
+
+    channel->server->stats_messages++;
+
+    // The ring slot is reused once this returns, processing and the trace need their own copy
+    GBytes *message = buffer_pool_new_bytes(data, size);
+    trace_writer_record_bytes(channel->server->trace_writer,
+                              connection_stream_id(channel->connection),
+                              TRACE_DIRECTION_IN,
+                              TRACE_FRAME_BINARY,
+                              message);
+    server_handle_binary_message(channel->server, channel->connection, message);
+    g_bytes_unref(message);
+
+    return TRUE;
+}
+
+#if defined(__linux__) && SOUP_CHECK_VERSION(3, 0, 0)
+static void server_shm_channel_free(gpointer data) {
+    ServerShmChannel *channel = data;
+
+    g_clear_handle_id(&channel->source_id, g_source_remove);
+    shm_ring_free(channel->ring);
+    g_free(channel);
+}
+#endif
+
+/// Returns FALSE if the ring is corrupt and has to be detached.
+static gboolean server_shm_channel_drain(ServerShmChannel *channel) {
+    GError *error = NULL;
+
+    if (!shm_ring_consume(channel->ring, server_shm_message_cb, channel, &error)) {
+        ALOGE("Dropping shared memory ring of client %p: %s", channel->connection, error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+#if defined(__linux__) && SOUP_CHECK_VERSION(3, 0, 0)
+static gboolean server_shm_readable_cb(gint fd, GIOCondition condition, gpointer user_data) {
+    ServerShmChannel *channel = user_data;
+
+    if (!server_shm_channel_drain(channel)) {
+        // The source is being dispatched, it goes away by returning G_SOURCE_REMOVE
+        channel->source_id = 0;
+        g_object_set_data(G_OBJECT(channel->connection), "shm_channel", NULL);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+#endif
+
+static void server_drain_connection_shm_channel(SoupWebsocketConnection *connection) {
+    ServerShmChannel *channel = g_object_get_data(G_OBJECT(connection), "shm_channel");
+
+    if (channel && !server_shm_channel_drain(channel)) {
+        g_object_set_data(G_OBJECT(connection), "shm_channel", NULL);
+    }
+}
+
 static void message_cb(SoupWebsocketConnection *connection, gint type, GBytes *message, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+
+    // Binary frames sent through shared memory before this message must be handled first
+    server_drain_connection_shm_channel(connection);
+
+    server->stats_messages++;
+
+    gsize length = 0;
+    const gchar *msg_data = g_bytes_get_data(message, &length);
+    trace_writer_record_bytes(
+        server->trace_writer, connection_stream_id(connection), TRACE_DIRECTION_IN, type, message);
+
     switch (type) {
         case SOUP_WEBSOCKET_DATA_BINARY: {
-            ALOGD("Received unknown binary message from client %p, ignoring", connection);
+            server_handle_binary_message(server, connection, message);
             break;
         }
         case SOUP_WEBSOCKET_DATA_TEXT: {
-            gsize length = 0;
-            const gchar *msg_str = g_bytes_get_data(message, &length);
-            ALOGD("Received text message from client %p: %s", connection, msg_str);
+            ALOGD("Received text message from client %p: %.*s", connection, (int)length, msg_data);
 
-            const gchar *reply_str = "OK, prepare to receive the binary data.";
-            soup_websocket_connection_send_text(connection, reply_str);
+            if (server_handle_json_message(server, connection, message)) {
+                break;
+            }
 
-            char test_data_buf[] = "This is some test binary data";
-            soup_websocket_connection_send_binary(connection, test_data_buf, ARRAY_SIZE(test_data_buf));
+            const gchar *reply_str = "OK, prepare to receive the binary data.";
+            server_send_text(server, connection, reply_str);
 
-            // server_handle_json_message(MY_SERVER(user_data), connection, message);
+            GBytes *test_data = g_bytes_new_static(test_data_buf, ARRAY_SIZE(test_data_buf));
+            server_send_binary(server, connection, test_data);
+            g_bytes_unref(test_data);
         } break;
         default:
             g_assert_not_reached();
     }
+
+    arena_reset(server->arena);
+
+    guint32 handled = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(connection), "websocket_messages"));
+    g_object_set_data(G_OBJECT(connection), "websocket_messages", GUINT_TO_POINTER(handled + 1));
+
+    // Binary frames sent through shared memory after this message may have been held back for it
+    server_drain_connection_shm_channel(connection);
 }
 
 static void server_remove_websocket_connection(Server *server, SoupWebsocketConnection *connection) {
@@ -145,6 +532,10 @@ static void server_remove_websocket_connection(Server *server, SoupWebsocketConn
 
     server->websocket_connections = g_slist_remove(server->websocket_connections, client_id);
 
+    processor_remove_stream(server->processor, connection);
+    mixer_remove_stream(server->mixer, connection);
+    g_object_set_data(G_OBJECT(connection), "shm_channel", NULL);
+
     g_signal_emit(server, signals[SIGNAL_WS_CLIENT_DISCONNECTED], 0, client_id);
 }
 
@@ -160,6 +551,8 @@ static void server_add_websocket_connection(Server *server, SoupWebsocketConnect
     g_object_ref(connection);
     server->websocket_connections = g_slist_append(server->websocket_connections, connection);
     g_object_set_data(G_OBJECT(connection), "client_id", connection);
+    g_object_set_data(G_OBJECT(connection), "stream_id", GUINT_TO_POINTER(server->next_stream_id++));
+    g_object_set_data_full(G_OBJECT(connection), "json_parser", json_parser_new(), g_object_unref);
 
     g_signal_connect(connection, "message", message_cb, server);
     g_signal_connect(connection, "closed", closed_cb, server);
@@ -186,14 +579,148 @@ static void websocket_cb(SoupServer *server,
                          gpointer user_data) {
     ALOGD("New connection from somewhere");
 
+    // Ties a shared memory ring handed over later to this connection
+    const char *shm_token =
+        soup_message_headers_get_one(soup_server_message_get_request_headers(msg), SHM_TOKEN_HEADER);
+    if (shm_token) {
+        g_object_set_data_full(G_OBJECT(connection), "shm_token", g_strdup(shm_token), g_free);
+    }
+
     server_add_websocket_connection(MY_SERVER(user_data), connection);
 }
 
 #endif
 
+#if defined(__linux__) && SOUP_CHECK_VERSION(3, 0, 0)
+static SoupWebsocketConnection *server_find_connection_by_shm_token(Server *server, const gchar *token) {
+    for (GSList *iter = server->websocket_connections; iter; iter = iter->next) {
+        const gchar *connection_token = g_object_get_data(G_OBJECT(iter->data), "shm_token");
+
+        if (connection_token && g_str_equal(connection_token, token)) {
+            return iter->data;
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean server_shm_handshake_cb(gint fd, GIOCondition condition, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+    GError *error = NULL;
+    gchar *token = NULL;
+
+    // The source goes away by returning G_SOURCE_REMOVE, on every path below
+    g_hash_table_remove(server->shm_handshakes, GINT_TO_POINTER(fd));
+
+    ShmRing *ring = shm_listener_receive(fd, &token, &error);
+    if (!ring) {
+        ALOGE("Shared memory handshake failed: %s", error->message);
+        g_clear_error(&error);
+        shm_listener_reply(fd, FALSE);
+        return G_SOURCE_REMOVE;
+    }
+
+    SoupWebsocketConnection *connection = server_find_connection_by_shm_token(server, token);
+    g_free(token);
+
+    if (!connection || g_object_get_data(G_OBJECT(connection), "shm_channel")) {
+        ALOGE("Shared memory handshake with an unknown or already attached token");
+        shm_ring_free(ring);
+        shm_listener_reply(fd, FALSE);
+        return G_SOURCE_REMOVE;
+    }
+
+    ServerShmChannel *channel = g_new0(ServerShmChannel, 1);
+    channel->server = server;
+    channel->connection = connection;
+    channel->ring = ring;
+    channel->source_id = g_unix_fd_add(shm_ring_get_eventfd(ring), G_IO_IN, server_shm_readable_cb, channel);
+    g_object_set_data_full(G_OBJECT(connection), "shm_channel", channel, server_shm_channel_free);
+
+    ALOGI("Client %p sends binary frames through shared memory", connection);
+
+    shm_listener_reply(fd, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean server_shm_accept_cb(gint fd, GIOCondition condition, gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+
+    int connection_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (connection_fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            ALOGE("Failed to accept shared memory connection: %s", g_strerror(errno));
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
+    // The producer sends its handshake right after connecting
+    guint source_id = g_unix_fd_add(connection_fd, G_IO_IN | G_IO_HUP | G_IO_ERR, server_shm_handshake_cb, server);
+    g_hash_table_insert(server->shm_handshakes, GINT_TO_POINTER(connection_fd), GUINT_TO_POINTER(source_id));
+
+    return G_SOURCE_CONTINUE;
+}
+#endif
+
+gboolean server_enable_shm_transport(Server *server, const char *socket_path, GError **error) {
+    g_return_val_if_fail(server->shm_listener_fd < 0, FALSE);
+
+#if defined(__linux__) && SOUP_CHECK_VERSION(3, 0, 0)
+    server->shm_listener_fd = shm_listener_open(socket_path, error);
+    if (server->shm_listener_fd < 0) {
+        return FALSE;
+    }
+
+    server->shm_socket_path = g_strdup(socket_path);
+    server->shm_listener_source_id = g_unix_fd_add(server->shm_listener_fd, G_IO_IN, server_shm_accept_cb, server);
+
+    ALOGI("Shared memory transport available on %s", socket_path);
+
+    return TRUE;
+#else
+    // libsoup 2 doesn't hand the handshake headers to websocket handlers
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Shared memory transport requires Linux and libsoup 3");
+    return FALSE;
+#endif
+}
+
+/// Buffer pool requests and misses per received message. Only the pool is counted, the allocations libsoup and
+/// json-glib make for each message don't go through it.
+static gboolean server_log_stats_cb(gpointer user_data) {
+    Server *server = MY_SERVER(user_data);
+
+    // Messages are received on this thread, the mixer and the processor workers allocate on their own
+    BufferPoolStats pool;
+    buffer_pool_get_thread_stats(&pool);
+
+    if (server->stats_messages > 0) {
+        gdouble messages = (gdouble)server->stats_messages;
+
+        BufferPoolStats process_pool;
+        buffer_pool_get_stats(&process_pool);
+
+        ALOGI("Receive path: %" G_GUINT64_FORMAT " messages, %.2f pool requests and %.2f pool misses per message, "
+              "%zu bytes cached by the process",
+              server->stats_messages,
+              (gdouble)(pool.requests - server->stats_last_pool.requests) / messages,
+              (gdouble)(pool.misses - server->stats_last_pool.misses) / messages,
+              process_pool.cached_bytes);
+    }
+
+    server->stats_messages = 0;
+    server->stats_last_pool = pool;
+
+    return G_SOURCE_CONTINUE;
+}
+
 static void server_init(Server *server) {
     GError *error = NULL;
 
+    server->shm_listener_fd = -1;
+#ifdef __linux__
+    server->shm_handshakes = g_hash_table_new(NULL, NULL);
+#endif
+
     server->soup_server = soup_server_new(NULL, NULL);
     g_assert_no_error(error);
 
@@ -203,6 +730,21 @@ static void server_init(Server *server) {
     soup_server_listen_all(server->soup_server, DEFAULT_PORT, 0, &error);
     g_assert_no_error(error);
 
+    server->mixer = mixer_new(NULL, server_mixer_output_cb, server);
+
+    ProcessorFuncs processor_funcs = {
+        .work = server_process_chunk,
+        .done = server_chunk_processed_cb,
+        .backpressure = server_backpressure_cb,
+        .result_free = server_chunk_levels_free,
+    };
+    server->processor = processor_new(NULL, 0, &processor_funcs, server);
+
+    server->arena = arena_new(4096);
+
+    buffer_pool_get_thread_stats(&server->stats_last_pool);
+    server->stats_source_id = g_timeout_add_seconds(STATS_INTERVAL_S, server_log_stats_cb, server);
+
     ALOGI("Server initialized, listening on: %u", DEFAULT_PORT);
 }
 
@@ -218,7 +760,7 @@ static void server_send_msg_to_client(Server *server, ClientId client_id, gchar
     SoupWebsocketState socket_state = soup_websocket_connection_get_state(connection);
 
     if (socket_state == SOUP_WEBSOCKET_STATE_OPEN) {
-        soup_websocket_connection_send_text(connection, msg_str);
+        server_send_text(server, connection, msg_str);
     } else {
         g_warning("Trying to send message using websocket that isn't open.");
     }
@@ -238,6 +780,46 @@ static void server_dispose(GObject *object) {
     soup_server_disconnect(self->soup_server);
     g_clear_object(&self->soup_server);
 
+    // Connections may outlive the server, nothing they receive from here on may reach it
+    for (GSList *iter = self->websocket_connections; iter; iter = iter->next) {
+        g_signal_handlers_disconnect_by_data(iter->data, self);
+        g_object_set_data(G_OBJECT(iter->data), "shm_channel", NULL);
+    }
+    g_slist_free_full(g_steal_pointer(&self->websocket_connections), g_object_unref);
+
+    // Processor threads push into the mixer
+    g_clear_pointer(&self->processor, processor_free);
+    g_clear_pointer(&self->mixer, mixer_free);
+    g_clear_pointer(&self->audio_buffer, g_bytes_unref);
+
+    g_clear_handle_id(&self->stats_source_id, g_source_remove);
+    g_clear_pointer(&self->arena, arena_free);
+
+#ifdef __linux__
+    g_clear_handle_id(&self->shm_listener_source_id, g_source_remove);
+
+    if (self->shm_handshakes) {
+        GHashTableIter iter;
+        gpointer fd, source_id;
+
+        g_hash_table_iter_init(&iter, self->shm_handshakes);
+        while (g_hash_table_iter_next(&iter, &fd, &source_id)) {
+            g_source_remove(GPOINTER_TO_UINT(source_id));
+            close(GPOINTER_TO_INT(fd));
+        }
+        g_clear_pointer(&self->shm_handshakes, g_hash_table_unref);
+    }
+
+    if (self->shm_listener_fd >= 0) {
+        close(self->shm_listener_fd);
+        self->shm_listener_fd = -1;
+        g_unlink(self->shm_socket_path);
+    }
+    g_clear_pointer(&self->shm_socket_path, g_free);
+#endif
+
+    g_clear_pointer(&self->trace_writer, trace_writer_close);
+
     ALOGD("Server disconnected");
 }
 
@@ -279,4 +861,16 @@ static void server_class_init(ServerClass *klass) {
                                                          2,
                                                          G_TYPE_POINTER,
                                                          G_TYPE_STRING);
+
+    signals[SIGNAL_DATA_CHUNK] = g_signal_new("data-chunk",
+                                              G_OBJECT_CLASS_TYPE(klass),
+                                              G_SIGNAL_RUN_LAST,
+                                              0,
+                                              NULL,
+                                              NULL,
+                                              NULL,
+                                              G_TYPE_NONE,
+                                              2,
+                                              G_TYPE_POINTER,
+                                              G_TYPE_BYTES);
 }
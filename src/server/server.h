@@ -9,3 +9,10 @@ G_DECLARE_FINAL_TYPE(Server, server, MY, SERVER, GObject)
 typedef gpointer ClientId;
 
 Server *server_new();
+
+/// Record every WebSocket frame sent or received by the server to a trace file.
+gboolean server_start_capture(Server *server, const char *path, GError **error);
+
+/// Let co-located clients send binary frames through a shared memory ring handed over on a Unix socket.
+gboolean server_enable_shm_transport(Server *server, const char *socket_path, GError **error);
+
@@ -0,0 +1,118 @@
+#include "arena.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#define ARENA_ALIGNMENT 16
+
+typedef struct _ArenaBlock ArenaBlock;
+
+struct _ArenaBlock {
+    ArenaBlock *next;
+    gsize size;
+    gsize used;
+    /// Keeps data aligned
+    gsize padding;
+    guint8 data[];
+};
+
+struct _Arena {
+    /// Most recent block first
+    ArenaBlock *blocks;
+    gsize block_size;
+    /// Bytes allocated since the last reset, across all blocks
+    gsize used;
+};
+
+static ArenaBlock *arena_block_new(gsize size, ArenaBlock *next) {
+    ArenaBlock *block = g_malloc(sizeof(ArenaBlock) + size);
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+Arena *arena_new(gsize block_size) {
+    Arena *arena = g_new0(Arena, 1);
+    arena->block_size = block_size;
+    arena->blocks = arena_block_new(block_size, NULL);
+
+    return arena;
+}
+
+void arena_free(Arena *arena) {
+    if (!arena) return;
+
+    while (arena->blocks) {
+        ArenaBlock *next = arena->blocks->next;
+        g_free(arena->blocks);
+        arena->blocks = next;
+    }
+
+    g_free(arena);
+}
+
+gpointer arena_alloc(Arena *arena, gsize size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(gsize)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->blocks;
+
+    if (block->size - block->used < size) {
+        block = arena_block_new(MAX(arena->block_size, size), block);
+        arena->blocks = block;
+    }
+
+    gpointer memory = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+
+    return memory;
+}
+
+gchar *arena_strdup_printf(Arena *arena, const gchar *format, ...) {
+    ArenaBlock *block = arena->blocks;
+    gsize available = block->size - block->used;
+
+    va_list args;
+    va_start(args, format);
+    int length = g_vsnprintf((gchar *)block->data + block->used, available, format, args);
+    va_end(args);
+
+    g_return_val_if_fail(length >= 0, NULL);
+
+    gchar *str;
+
+    if ((gsize)length < available) {
+        // Formatted in place, claim the space it took
+        str = (gchar *)block->data + block->used;
+        arena_alloc(arena, length + 1);
+    } else {
+        str = arena_alloc(arena, length + 1);
+
+        va_start(args, format);
+        g_vsnprintf(str, length + 1, format, args);
+        va_end(args);
+    }
+
+    return str;
+}
+
+void arena_reset(Arena *arena) {
+    // Replace a chain of blocks by one that fits all of it, the next message like this one needs a single block
+    if (arena->blocks->next) {
+        gsize size = MAX(arena->block_size, arena->used);
+
+        while (arena->blocks) {
+            ArenaBlock *next = arena->blocks->next;
+            g_free(arena->blocks);
+            arena->blocks = next;
+        }
+
+        arena->block_size = size;
+        arena->blocks = arena_block_new(size, NULL);
+    }
+
+    arena->blocks->used = 0;
+    arena->used = 0;
+}
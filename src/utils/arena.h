@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bump allocator for scratch memory that lives as long as one message.
+ *
+ * Everything allocated from the arena is released at once by arena_reset(). The arena keeps one block sized to the
+ * largest message seen, so that an arena reset after every message stops allocating once it has warmed up.
+ */
+
+typedef struct _Arena Arena;
+
+Arena *arena_new(gsize block_size);
+
+void arena_free(Arena *arena);
+
+/// The memory is 16-byte aligned.
+gpointer arena_alloc(Arena *arena, gsize size);
+
+gchar *arena_strdup_printf(Arena *arena, const gchar *format, ...) G_GNUC_PRINTF(2, 3);
+
+void arena_reset(Arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
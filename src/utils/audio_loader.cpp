@@ -2,6 +2,7 @@
 
 #include <AL/al.h>
 
+#include <algorithm>
 #include <bit>
 #include <cstddef>
 #include <cstdint>
@@ -158,3 +159,37 @@ char* load_wav(const std::string& filename,
 char* load_wav_c(const char* filename, guint8* channels, gint32* sampleRate, guint8* bitsPerSample, int* size) {
     return load_wav(filename, *channels, *sampleRate, *bitsPerSample, *size);
 }
+
+GBytes* load_wav_bytes_c(const char* filename, guint8* channels, gint32* sampleRate, guint8* bitsPerSample) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "ERROR: Could not open \"" << filename << "\"" << std::endl;
+        return nullptr;
+    }
+
+    ALsizei size;
+    if (!load_wav_file_header(in, *channels, *sampleRate, *bitsPerSample, size)) {
+        std::cerr << "ERROR: Could not load wav header of \"" << filename << "\"" << std::endl;
+        return nullptr;
+    }
+    std::size_t data_offset = in.tellg();
+    in.close();
+
+    GError* error = nullptr;
+    GMappedFile* mapped_file = g_mapped_file_new(filename, FALSE, &error);
+    if (!mapped_file) {
+        std::cerr << "ERROR: Could not map \"" << filename << "\": " << error->message << std::endl;
+        g_clear_error(&error);
+        return nullptr;
+    }
+
+    GBytes* contents = g_mapped_file_get_bytes(mapped_file);
+    g_mapped_file_unref(mapped_file);
+
+    // Truncated files only provide what is there
+    std::size_t available = g_bytes_get_size(contents) - data_offset;
+    GBytes* data = g_bytes_new_from_bytes(contents, data_offset, std::min<std::size_t>(size, available));
+    g_bytes_unref(contents);
+
+    return data;
+}
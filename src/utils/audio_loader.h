@@ -8,6 +8,9 @@ extern "C" {
 
 char* load_wav_c(const char* filename, guint8* channels, gint32* sampleRate, guint8* bitsPerSample, int* size);
 
+/// Maps the file instead of reading it, the returned bytes are a slice of the mapping covering the PCM data.
+GBytes* load_wav_bytes_c(const char* filename, guint8* channels, gint32* sampleRate, guint8* bitsPerSample);
+
 #ifdef __cplusplus
 }
 #endif
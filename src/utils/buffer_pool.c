@@ -0,0 +1,165 @@
+#include "buffer_pool.h"
+
+#include <string.h>
+
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 22
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+
+/// Free blocks kept per class, split evenly between the classes
+#define BUFFER_POOL_CACHE_BYTES (32 * 1024 * 1024)
+#define BUFFER_POOL_MIN_FREE_BLOCKS 2
+
+#define BUFFER_POOL_OVERSIZED G_MAXUINT
+
+/// Precedes every block, its size keeps the payload 16-byte aligned
+typedef struct {
+    guint size_class;
+} BufferPoolHeader;
+
+#define BUFFER_POOL_HEADER_SIZE 16
+
+G_STATIC_ASSERT(sizeof(BufferPoolHeader) <= BUFFER_POOL_HEADER_SIZE);
+
+typedef struct {
+    GMutex mutex;
+    /// Released blocks, linked through their first bytes
+    gpointer free_list;
+    guint free_count;
+    guint max_free;
+
+    guint64 requests;
+    guint64 misses;
+} BufferPoolClass;
+
+static BufferPoolClass pool_classes[BUFFER_POOL_CLASSES];
+
+/// Requests and misses of the calling thread, so that one code path can be told apart from the rest of the process
+static GPrivate thread_stats = G_PRIVATE_INIT(g_free);
+
+static BufferPoolStats *buffer_pool_thread_stats(void) {
+    BufferPoolStats *stats = g_private_get(&thread_stats);
+
+    if (!stats) {
+        stats = g_new0(BufferPoolStats, 1);
+        g_private_set(&thread_stats, stats);
+    }
+
+    return stats;
+}
+
+static void buffer_pool_init(void) {
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        for (guint i = 0; i < BUFFER_POOL_CLASSES; i++) {
+            gsize block_size = (gsize)1 << (BUFFER_POOL_MIN_SHIFT + i);
+
+            g_mutex_init(&pool_classes[i].mutex);
+            pool_classes[i].max_free =
+                MAX(BUFFER_POOL_MIN_FREE_BLOCKS, BUFFER_POOL_CACHE_BYTES / BUFFER_POOL_CLASSES / block_size);
+        }
+
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+static guint buffer_pool_size_class(gsize size) {
+    guint shift = size > 1 ? g_bit_storage(size - 1) : 0;
+    shift = MAX(shift, BUFFER_POOL_MIN_SHIFT);
+
+    return shift <= BUFFER_POOL_MAX_SHIFT ? shift - BUFFER_POOL_MIN_SHIFT : BUFFER_POOL_OVERSIZED;
+}
+
+static gpointer buffer_pool_new_block(guint size_class, gsize size) {
+    BufferPoolHeader *header = g_malloc(BUFFER_POOL_HEADER_SIZE + size);
+    header->size_class = size_class;
+
+    return (guint8 *)header + BUFFER_POOL_HEADER_SIZE;
+}
+
+gpointer buffer_pool_alloc(gsize size) {
+    buffer_pool_init();
+
+    guint size_class = buffer_pool_size_class(size);
+
+    if (size_class == BUFFER_POOL_OVERSIZED) {
+        return buffer_pool_new_block(size_class, size);
+    }
+
+    BufferPoolClass *klass = &pool_classes[size_class];
+    BufferPoolStats *stats = buffer_pool_thread_stats();
+
+    g_mutex_lock(&klass->mutex);
+
+    klass->requests++;
+
+    gpointer block = klass->free_list;
+    if (block) {
+        klass->free_list = *(gpointer *)block;
+        klass->free_count--;
+    } else {
+        klass->misses++;
+    }
+
+    g_mutex_unlock(&klass->mutex);
+
+    stats->requests++;
+    stats->misses += block ? 0 : 1;
+
+    if (!block) {
+        block = buffer_pool_new_block(size_class, (gsize)1 << (BUFFER_POOL_MIN_SHIFT + size_class));
+    }
+
+    return block;
+}
+
+void buffer_pool_release(gpointer block) {
+    if (!block) return;
+
+    BufferPoolHeader *header = (BufferPoolHeader *)((guint8 *)block - BUFFER_POOL_HEADER_SIZE);
+
+    if (header->size_class != BUFFER_POOL_OVERSIZED) {
+        BufferPoolClass *klass = &pool_classes[header->size_class];
+
+        g_mutex_lock(&klass->mutex);
+
+        if (klass->free_count < klass->max_free) {
+            *(gpointer *)block = klass->free_list;
+            klass->free_list = block;
+            klass->free_count++;
+            header = NULL;
+        }
+
+        g_mutex_unlock(&klass->mutex);
+    }
+
+    g_free(header);
+}
+
+GBytes *buffer_pool_new_bytes(gconstpointer data, gsize size) {
+    gpointer block = buffer_pool_alloc(size);
+    memcpy(block, data, size);
+
+    return g_bytes_new_with_free_func(block, size, buffer_pool_release, block);
+}
+
+void buffer_pool_get_stats(BufferPoolStats *stats) {
+    buffer_pool_init();
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (guint i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        BufferPoolClass *klass = &pool_classes[i];
+
+        g_mutex_lock(&klass->mutex);
+        stats->requests += klass->requests;
+        stats->misses += klass->misses;
+        stats->cached_bytes += (gsize)klass->free_count << (BUFFER_POOL_MIN_SHIFT + i);
+        g_mutex_unlock(&klass->mutex);
+    }
+}
+
+void buffer_pool_get_thread_stats(BufferPoolStats *stats) {
+    *stats = *buffer_pool_thread_stats();
+}
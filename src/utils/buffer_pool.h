@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Size-class buffer pool for message payloads and per-message bookkeeping.
+ *
+ * Requests are rounded up to a power of two between 64 bytes and 4 MB, larger ones go straight to the allocator.
+ * Released blocks stay on a free list of their class up to a byte budget, so that steady-state message handling
+ * reuses them instead of allocating. There is one pool per process, blocks may be released on any thread.
+ */
+
+typedef struct {
+    guint64 requests;
+    /// Requests that had to go to the allocator
+    guint64 misses;
+    gsize cached_bytes;
+} BufferPoolStats;
+
+/// The block is 16-byte aligned.
+gpointer buffer_pool_alloc(gsize size);
+
+void buffer_pool_release(gpointer block);
+
+/// Copies data into a pooled block, which is released when the GBytes is freed.
+GBytes *buffer_pool_new_bytes(gconstpointer data, gsize size);
+
+/// Totals of the whole process.
+void buffer_pool_get_stats(BufferPoolStats *stats);
+
+/// Requests made on the calling thread, cached_bytes is always 0.
+void buffer_pool_get_thread_stats(BufferPoolStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
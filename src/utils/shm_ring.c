@@ -0,0 +1,539 @@
+#ifdef __linux__
+    // memfd_create()
+    #define _GNU_SOURCE
+#endif
+
+#include "shm_ring.h"
+
+#include <gio/gio.h>
+#include <string.h>
+
+#ifdef __linux__
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sys/eventfd.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+#define SHM_RING_MAGIC 0x52534d57 // "WMSR"
+
+/// Length value telling the consumer to continue at the start of the ring
+#define SHM_RING_WRAP G_MAXUINT32
+
+/// The wrap marker is only the length, it may be all that fits before the end of the ring
+#define SHM_RECORD_LENGTH_SIZE 4
+#define SHM_RECORD_HEADER_SIZE 8
+#define SHM_ALIGN(size) (((size) + 3) & ~(gsize)3)
+
+#define SHM_TOKEN_MAX 64
+#define SHM_HANDSHAKE_MAGIC "SHM1"
+
+/// Descriptors the handshake carries, the consumer has room for more so that it can close whatever it was sent
+#define SHM_HANDSHAKE_FDS 2
+#define SHM_HANDSHAKE_MAX_FDS 8
+
+/// Lives at the start of the shared mapping. Positions run freely and are reduced modulo the capacity, head and tail
+/// sit on separate cache lines as they are written by different processes.
+typedef struct {
+    guint32 magic;
+    guint32 capacity;
+    guint8 padding0[56];
+
+    /// Written by the producer
+    gint head;
+    guint8 padding1[60];
+
+    /// Written by the consumer
+    gint tail;
+    guint8 padding2[60];
+} ShmRingHeader;
+
+typedef struct {
+    char magic[4];
+    char token[SHM_TOKEN_MAX];
+} ShmHandshake;
+
+struct _ShmRing {
+    int memfd;
+    int eventfd;
+
+    ShmRingHeader *header;
+    guint8 *data;
+    gsize capacity;
+    gsize mapping_size;
+
+    /// Consumer position, the shared tail is only published from it as the producer could overwrite it
+    guint32 tail;
+};
+
+gboolean shm_ring_supported(void) {
+#ifdef __linux__
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+#ifdef __linux__
+
+static void set_error_from_errno(GError **error, const char *what) {
+    int saved_errno = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno), "%s: %s", what, g_strerror(saved_errno));
+}
+
+static ShmRing *shm_ring_map(int memfd, int eventfd, gsize capacity, GError **error) {
+    gsize mapping_size = sizeof(ShmRingHeader) + capacity;
+
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mapping == MAP_FAILED) {
+        set_error_from_errno(error, "mmap");
+        return NULL;
+    }
+
+    ShmRing *ring = g_new0(ShmRing, 1);
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+    ring->header = mapping;
+    ring->data = (guint8 *)mapping + sizeof(ShmRingHeader);
+    ring->capacity = capacity;
+    ring->mapping_size = mapping_size;
+
+    return ring;
+}
+
+static ShmRing *shm_ring_new(gsize capacity, GError **error) {
+    g_return_val_if_fail(capacity >= 4096 && (capacity & (capacity - 1)) == 0 && capacity <= (1u << 30), NULL);
+
+    int memfd = memfd_create("ws_demo_shm_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        set_error_from_errno(error, "memfd_create");
+        return NULL;
+    }
+
+    if (ftruncate(memfd, sizeof(ShmRingHeader) + capacity) < 0) {
+        set_error_from_errno(error, "ftruncate");
+        close(memfd);
+        return NULL;
+    }
+
+    // The consumer only maps rings that can't shrink under it
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+        set_error_from_errno(error, "fcntl");
+        close(memfd);
+        return NULL;
+    }
+
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd < 0) {
+        set_error_from_errno(error, "eventfd");
+        close(memfd);
+        return NULL;
+    }
+
+    ShmRing *ring = shm_ring_map(memfd, event_fd, capacity, error);
+    if (!ring) {
+        close(event_fd);
+        close(memfd);
+        return NULL;
+    }
+
+    ring->header->magic = SHM_RING_MAGIC;
+    ring->header->capacity = capacity;
+
+    return ring;
+}
+
+/// Passes the ring's file descriptors to the consumer along with the token.
+static gboolean shm_ring_send_handshake(int fd, ShmRing *ring, const char *token, GError **error) {
+    ShmHandshake handshake = {.magic = SHM_HANDSHAKE_MAGIC};
+    strcpy(handshake.token, token);
+
+    struct iovec iov = {.iov_base = &handshake, .iov_len = sizeof(handshake)};
+
+    int fds[SHM_HANDSHAKE_FDS] = {ring->memfd, ring->eventfd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) != sizeof(handshake)) {
+        set_error_from_errno(error, "sendmsg");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+ShmRing *shm_ring_connect(const char *socket_path, const char *token, gsize capacity, GError **error) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (strlen(socket_path) >= sizeof(address.sun_path) || strlen(token) >= SHM_TOKEN_MAX) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Socket path or token too long");
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    ShmRing *ring = shm_ring_new(capacity, error);
+    if (!ring) {
+        return NULL;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        set_error_from_errno(error, "socket");
+        goto fail;
+    }
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        set_error_from_errno(error, "connect");
+        goto fail;
+    }
+
+    // Don't hang the sender if the server never answers
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (!shm_ring_send_handshake(fd, ring, token, error)) {
+        goto fail;
+    }
+
+    guint8 accepted = 0;
+    if (recv(fd, &accepted, 1, 0) != 1 || !accepted) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED, "Server rejected the shared memory ring");
+        goto fail;
+    }
+
+    close(fd);
+
+    return ring;
+
+fail:
+    if (fd >= 0) close(fd);
+    shm_ring_free(ring);
+    return NULL;
+}
+
+gboolean shm_ring_write(ShmRing *ring, guint32 sequence, gconstpointer data, gsize size) {
+    gsize record_size = SHM_RECORD_HEADER_SIZE + SHM_ALIGN(size);
+    if (record_size > ring->capacity) {
+        return FALSE;
+    }
+
+    guint32 head = (guint32)ring->header->head;
+    guint32 tail = (guint32)g_atomic_int_get(&ring->header->tail);
+
+    gsize offset = head & (ring->capacity - 1);
+    gsize contiguous = ring->capacity - offset;
+    gsize needed = record_size > contiguous ? contiguous + record_size : record_size;
+
+    if (ring->capacity - (guint32)(head - tail) < needed) {
+        return FALSE;
+    }
+
+    // Records never straddle the end of the ring
+    if (record_size > contiguous) {
+        guint32 wrap = SHM_RING_WRAP;
+        memcpy(ring->data + offset, &wrap, SHM_RECORD_LENGTH_SIZE);
+        head += contiguous;
+        offset = 0;
+    }
+
+    guint32 length = size;
+    memcpy(ring->data + offset, &length, SHM_RECORD_LENGTH_SIZE);
+    memcpy(ring->data + offset + SHM_RECORD_LENGTH_SIZE, &sequence, sizeof(sequence));
+    memcpy(ring->data + offset + SHM_RECORD_HEADER_SIZE, data, size);
+
+    // Publishes the payload before the consumer can see the new head
+    g_atomic_int_set(&ring->header->head, (gint)(head + record_size));
+
+    guint64 one = 1;
+    if (write(ring->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        g_warning("Failed to signal shared memory ring: %s", g_strerror(errno));
+    }
+
+    return TRUE;
+}
+
+gsize shm_ring_get_max_message_size(ShmRing *ring) {
+    // Any message up to half the ring fits into an empty ring, wherever the wrap point is
+    return ring->capacity / 2 - SHM_RECORD_HEADER_SIZE;
+}
+
+int shm_listener_open(const char *socket_path, GError **error) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Socket path too long");
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        set_error_from_errno(error, "socket");
+        return -1;
+    }
+
+    // A stale socket file from a previous run would make bind() fail
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+        set_error_from_errno(error, "bind");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/// The consumer reads the eventfd on its main loop, anything that could block it is refused.
+static gboolean shm_make_eventfd_nonblocking(int fd) {
+    gchar path[32];
+    g_snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    char target[32];
+    ssize_t length = readlink(path, target, sizeof(target) - 1);
+    if (length < 0) {
+        return FALSE;
+    }
+    target[length] = '\0';
+
+    if (!g_str_equal(target, "anon_inode:[eventfd]")) {
+        return FALSE;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+ShmRing *shm_listener_receive(int connection_fd, gchar **token, GError **error) {
+    ShmHandshake handshake;
+    struct iovec iov = {.iov_base = &handshake, .iov_len = sizeof(handshake)};
+
+    union {
+        char buffer[CMSG_SPACE(SHM_HANDSHAKE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+
+    ssize_t received = recvmsg(connection_fd, &message, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        set_error_from_errno(error, "recvmsg");
+        return NULL;
+    }
+
+    // Every descriptor that arrived is now ours and has to be closed unless it becomes part of the ring
+    int delivered[SHM_HANDSHAKE_MAX_FDS];
+    guint delivered_count = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        gsize count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (gsize i = 0; i < count && delivered_count < SHM_HANDSHAKE_MAX_FDS; i++) {
+            memcpy(&delivered[delivered_count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        }
+    }
+
+    int fds[SHM_HANDSHAKE_FDS] = {-1, -1};
+
+    if (delivered_count == SHM_HANDSHAKE_FDS) {
+        memcpy(fds, delivered, sizeof(fds));
+    } else {
+        for (guint i = 0; i < delivered_count; i++) {
+            close(delivered[i]);
+        }
+    }
+
+    struct stat memfd_stat;
+
+    if (received != sizeof(handshake) || memcmp(handshake.magic, SHM_HANDSHAKE_MAGIC, 4) != 0 ||
+        memchr(handshake.token, '\0', SHM_TOKEN_MAX) == NULL || fds[0] < 0 || fds[1] < 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid shared memory handshake");
+        goto fail;
+    }
+
+    if (!shm_make_eventfd_nonblocking(fds[1])) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Shared memory ring signal is not an eventfd");
+        goto fail;
+    }
+
+    // Truncating an unsealed memfd would make the mapping fault with SIGBUS
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Shared memory ring is not sealed against shrinking");
+        goto fail;
+    }
+
+    if (fstat(fds[0], &memfd_stat) < 0) {
+        set_error_from_errno(error, "fstat");
+        goto fail;
+    }
+
+    ShmRingHeader header;
+    if (memfd_stat.st_size < (off_t)sizeof(header) || pread(fds[0], &header, sizeof(header), 0) != sizeof(header)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Shared memory ring too small");
+        goto fail;
+    }
+
+    // The producer is untrusted, its ring must be exactly as large as it claims
+    gsize capacity = header.capacity;
+    if (header.magic != SHM_RING_MAGIC || capacity < 4096 || (capacity & (capacity - 1)) != 0 ||
+        capacity > (1u << 30) || (gsize)memfd_stat.st_size != sizeof(ShmRingHeader) + capacity) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid shared memory ring");
+        goto fail;
+    }
+
+    ShmRing *ring = shm_ring_map(fds[0], fds[1], capacity, error);
+    if (!ring) {
+        goto fail;
+    }
+
+    *token = g_strdup(handshake.token);
+
+    return ring;
+
+fail:
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    return NULL;
+}
+
+void shm_listener_reply(int connection_fd, gboolean accepted) {
+    guint8 reply = accepted ? 1 : 0;
+    if (send(connection_fd, &reply, 1, MSG_NOSIGNAL) != 1) {
+        g_warning("Failed to answer shared memory handshake: %s", g_strerror(errno));
+    }
+
+    close(connection_fd);
+}
+
+int shm_ring_get_eventfd(ShmRing *ring) {
+    return ring->eventfd;
+}
+
+gboolean shm_ring_consume(ShmRing *ring, ShmRingFunc func, gpointer user_data, GError **error) {
+    // A single read returns and resets the whole counter
+    guint64 counter;
+    if (read(ring->eventfd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        g_warning("Failed to reset shared memory ring signal: %s", g_strerror(errno));
+    }
+
+    guint32 tail = ring->tail;
+    guint32 head = (guint32)g_atomic_int_get(&ring->header->head);
+
+    // Everything read from the ring is written by the producer and checked before it's used
+    if ((guint32)(head - tail) > ring->capacity) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Corrupt shared memory ring head");
+        return FALSE;
+    }
+
+    while (tail != head) {
+        gsize offset = tail & (ring->capacity - 1);
+        gsize contiguous = ring->capacity - offset;
+
+        guint32 length;
+        memcpy(&length, ring->data + offset, SHM_RECORD_LENGTH_SIZE);
+
+        if (length == SHM_RING_WRAP) {
+            if (contiguous > (guint32)(head - tail)) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Corrupt shared memory ring wrap marker");
+                return FALSE;
+            }
+
+            tail += contiguous;
+        } else {
+            gsize record_size = SHM_RECORD_HEADER_SIZE + SHM_ALIGN((gsize)length);
+
+            if (record_size > contiguous || record_size > (guint32)(head - tail)) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Corrupt shared memory ring record");
+                return FALSE;
+            }
+
+            guint32 sequence;
+            memcpy(&sequence, ring->data + offset + SHM_RECORD_LENGTH_SIZE, sizeof(sequence));
+
+            if (!func(sequence, ring->data + offset + SHM_RECORD_HEADER_SIZE, length, user_data)) {
+                break;
+            }
+            tail += record_size;
+        }
+
+        // Frees the space as early as possible
+        ring->tail = tail;
+        g_atomic_int_set(&ring->header->tail, (gint)tail);
+    }
+
+    return TRUE;
+}
+
+void shm_ring_free(ShmRing *ring) {
+    if (!ring) return;
+
+    munmap(ring->header, ring->mapping_size);
+    close(ring->eventfd);
+    close(ring->memfd);
+    g_free(ring);
+}
+
+#else
+
+ShmRing *shm_ring_connect(const char *socket_path, const char *token, gsize capacity, GError **error) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Shared memory transport is not supported");
+    return NULL;
+}
+
+gboolean shm_ring_write(ShmRing *ring, guint32 sequence, gconstpointer data, gsize size) {
+    return FALSE;
+}
+
+gsize shm_ring_get_max_message_size(ShmRing *ring) {
+    return 0;
+}
+
+int shm_listener_open(const char *socket_path, GError **error) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Shared memory transport is not supported");
+    return -1;
+}
+
+ShmRing *shm_listener_receive(int connection_fd, gchar **token, GError **error) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Shared memory transport is not supported");
+    return NULL;
+}
+
+void shm_listener_reply(int connection_fd, gboolean accepted) {
+}
+
+int shm_ring_get_eventfd(ShmRing *ring) {
+    return -1;
+}
+
+gboolean shm_ring_consume(ShmRing *ring, ShmRingFunc func, gpointer user_data, GError **error) {
+    return TRUE;
+}
+
+void shm_ring_free(ShmRing *ring) {
+}
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Single-producer single-consumer message ring in shared memory, for senders co-located with the server.
+ *
+ * The producer creates the ring (a memfd) and an eventfd, and hands both to the server over a Unix socket together
+ * with the token it sent in the X-Shm-Token WebSocket handshake header, which ties the ring to that connection.
+ * Messages are written as [u32 length | u32 sequence | payload] and the eventfd is signalled after each one. The
+ * sequence is up to the producer, it lets the consumer order messages against those it receives on another channel.
+ *
+ * Only available on Linux, shm_ring_supported() returns FALSE elsewhere.
+ */
+
+#define SHM_TOKEN_HEADER "X-Shm-Token"
+
+#define SHM_SOCKET_PATH_DEFAULT "/tmp/ws_demo_shm.sock"
+
+/// Default ring size, must be a power of two
+#define SHM_RING_CAPACITY_DEFAULT (16 * 1024 * 1024)
+
+typedef struct _ShmRing ShmRing;
+
+/// Called for each message, data points into the ring and is only valid during the call. Returning FALSE leaves the
+/// message and the ones after it in the ring for a later shm_ring_consume() call.
+typedef gboolean (*ShmRingFunc)(guint32 sequence, gconstpointer data, gsize size, gpointer user_data);
+
+gboolean shm_ring_supported(void);
+
+/*
+ * Producer side.
+ */
+
+/// Creates a ring and hands it to the server listening on socket_path.
+ShmRing *shm_ring_connect(const char *socket_path, const char *token, gsize capacity, GError **error);
+
+/// Returns FALSE without writing anything if the ring has no room for the message.
+gboolean shm_ring_write(ShmRing *ring, guint32 sequence, gconstpointer data, gsize size);
+
+/// Largest message the ring accepts.
+gsize shm_ring_get_max_message_size(ShmRing *ring);
+
+/*
+ * Consumer side.
+ */
+
+/// Listening socket for producers, returns -1 on error.
+int shm_listener_open(const char *socket_path, GError **error);
+
+/// Receives a ring from a connection accepted on the listening socket.
+ShmRing *shm_listener_receive(int connection_fd, gchar **token, GError **error);
+
+/// Tells the producer whether its ring was accepted and closes the connection.
+void shm_listener_reply(int connection_fd, gboolean accepted);
+
+/// Readable whenever messages were written, shm_ring_consume() resets it.
+int shm_ring_get_eventfd(ShmRing *ring);
+
+/// Calls func for each pending message until it returns FALSE. Returns FALSE if the ring is corrupt.
+gboolean shm_ring_consume(ShmRing *ring, ShmRingFunc func, gpointer user_data, GError **error);
+
+void shm_ring_free(ShmRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,265 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef G_OS_UNIX
+    #include <sys/uio.h>
+    #include <unistd.h>
+#endif
+
+#define TRACE_MAGIC "WSTR"
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_HEADER_SIZE 18
+
+/// Records are batched up to either limit, a capture lost with the process loses at most one batch
+#define TRACE_BATCH_RECORDS 64
+#define TRACE_BATCH_SIZE (64 * 1024)
+
+struct _TraceWriter {
+    FILE *file;
+    gint64 start_us;
+
+    /// Payloads are referenced until the batch is written rather than copied
+    guint8 headers[TRACE_BATCH_RECORDS][TRACE_RECORD_HEADER_SIZE];
+    GBytes *payloads[TRACE_BATCH_RECORDS];
+    guint batch_records;
+    gsize batch_size;
+};
+
+struct _TraceReader {
+    GMappedFile *mapped_file;
+    GBytes *contents;
+    TraceRole role;
+    gsize offset;
+};
+
+TraceWriter *trace_writer_open(const char *path, TraceRole role, GError **error) {
+    FILE *file = g_fopen(path, "wb");
+    if (!file) {
+        int saved_errno = errno;
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Could not open trace file %s: %s",
+                    path,
+                    g_strerror(saved_errno));
+        return NULL;
+    }
+
+    TraceWriter *writer = g_new0(TraceWriter, 1);
+    writer->file = file;
+    writer->start_us = g_get_monotonic_time();
+
+    guint8 header[TRACE_HEADER_SIZE] = {0};
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    header[5] = role;
+
+    gint64 wall_clock_le = GINT64_TO_LE(g_get_real_time());
+    memcpy(header + 8, &wall_clock_le, 8);
+
+    fwrite(header, 1, sizeof(header), writer->file);
+    // On Unix records are written around the stdio buffer
+    fflush(writer->file);
+
+    return writer;
+}
+
+#ifdef G_OS_UNIX
+
+/// Writes all vectors, advancing them past partial writes.
+static gboolean trace_writer_writev(int fd, struct iovec *vectors, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, vectors, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+
+        while (count > 0 && (gsize)written >= vectors->iov_len) {
+            written -= (ssize_t)vectors->iov_len;
+            vectors++;
+            count--;
+        }
+
+        if (count > 0) {
+            vectors->iov_base = (guint8 *)vectors->iov_base + written;
+            vectors->iov_len -= (gsize)written;
+        }
+    }
+
+    return TRUE;
+}
+
+#endif
+
+static void trace_writer_flush(TraceWriter *writer) {
+    if (writer->batch_records == 0) return;
+
+    gboolean written = TRUE;
+
+#ifdef G_OS_UNIX
+    // Straight from the payloads into the file, the stdio buffer only ever held the file header
+    struct iovec vectors[2 * TRACE_BATCH_RECORDS];
+    int count = 0;
+
+    for (guint i = 0; i < writer->batch_records; i++) {
+        gsize size = 0;
+        gconstpointer data = g_bytes_get_data(writer->payloads[i], &size);
+
+        vectors[count].iov_base = writer->headers[i];
+        vectors[count].iov_len = TRACE_RECORD_HEADER_SIZE;
+        count++;
+
+        if (size > 0) {
+            vectors[count].iov_base = (gpointer)data;
+            vectors[count].iov_len = size;
+            count++;
+        }
+    }
+
+    written = trace_writer_writev(fileno(writer->file), vectors, count);
+#else
+    for (guint i = 0; i < writer->batch_records && written; i++) {
+        gsize size = 0;
+        gconstpointer data = g_bytes_get_data(writer->payloads[i], &size);
+
+        written = fwrite(writer->headers[i], 1, TRACE_RECORD_HEADER_SIZE, writer->file) == TRACE_RECORD_HEADER_SIZE &&
+                  fwrite(data, 1, size, writer->file) == size;
+    }
+#endif
+
+    if (!written) {
+        g_warning("Failed to write trace records: %s", g_strerror(errno));
+    }
+
+    for (guint i = 0; i < writer->batch_records; i++) {
+        g_clear_pointer(&writer->payloads[i], g_bytes_unref);
+    }
+    writer->batch_records = 0;
+    writer->batch_size = 0;
+}
+
+void trace_writer_record_bytes(TraceWriter *writer,
+                               guint32 stream,
+                               TraceDirection direction,
+                               TraceFrameType type,
+                               GBytes *payload) {
+    if (!writer) return;
+
+    gsize size = g_bytes_get_size(payload);
+    guint8 *header = writer->headers[writer->batch_records];
+
+    guint64 timestamp_le = GUINT64_TO_LE((guint64)(g_get_monotonic_time() - writer->start_us));
+    guint32 stream_le = GUINT32_TO_LE(stream);
+    guint32 size_le = GUINT32_TO_LE((guint32)size);
+
+    memcpy(header, &timestamp_le, 8);
+    memcpy(header + 8, &stream_le, 4);
+    header[12] = direction;
+    header[13] = type;
+    memcpy(header + 14, &size_le, 4);
+
+    writer->payloads[writer->batch_records++] = g_bytes_ref(payload);
+    writer->batch_size += TRACE_RECORD_HEADER_SIZE + size;
+
+    if (writer->batch_records == TRACE_BATCH_RECORDS || writer->batch_size >= TRACE_BATCH_SIZE) {
+        trace_writer_flush(writer);
+    }
+}
+
+void trace_writer_record(TraceWriter *writer,
+                         guint32 stream,
+                         TraceDirection direction,
+                         TraceFrameType type,
+                         gconstpointer data,
+                         gsize size) {
+    if (!writer) return;
+
+    GBytes *payload = g_bytes_new(data, size);
+    trace_writer_record_bytes(writer, stream, direction, type, payload);
+    g_bytes_unref(payload);
+}
+
+void trace_writer_close(TraceWriter *writer) {
+    if (!writer) return;
+
+    trace_writer_flush(writer);
+
+    fclose(writer->file);
+    g_free(writer);
+}
+
+TraceReader *trace_reader_open(const char *path, GError **error) {
+    GMappedFile *mapped_file = g_mapped_file_new(path, FALSE, error);
+    if (!mapped_file) {
+        return NULL;
+    }
+
+    gsize length = g_mapped_file_get_length(mapped_file);
+    const guint8 *data = (const guint8 *)g_mapped_file_get_contents(mapped_file);
+
+    if (length < TRACE_HEADER_SIZE || memcmp(data, TRACE_MAGIC, 4) != 0 || data[4] != TRACE_VERSION) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a version %d trace", path, TRACE_VERSION);
+        g_mapped_file_unref(mapped_file);
+        return NULL;
+    }
+
+    TraceReader *reader = g_new0(TraceReader, 1);
+    reader->mapped_file = mapped_file;
+    reader->contents = g_mapped_file_get_bytes(mapped_file);
+    reader->role = data[5];
+    reader->offset = TRACE_HEADER_SIZE;
+
+    return reader;
+}
+
+TraceRole trace_reader_get_role(TraceReader *reader) {
+    return reader->role;
+}
+
+gboolean trace_reader_next(TraceReader *reader, TraceRecord *record) {
+    gsize length = 0;
+    const guint8 *data = g_bytes_get_data(reader->contents, &length);
+
+    if (length - reader->offset < TRACE_RECORD_HEADER_SIZE) {
+        return FALSE;
+    }
+
+    const guint8 *header = data + reader->offset;
+
+    guint64 timestamp_le;
+    guint32 stream_le;
+    guint32 size_le;
+    memcpy(&timestamp_le, header, 8);
+    memcpy(&stream_le, header + 8, 4);
+    memcpy(&size_le, header + 14, 4);
+
+    gsize size = GUINT32_FROM_LE(size_le);
+    gsize payload_offset = reader->offset + TRACE_RECORD_HEADER_SIZE;
+
+    if (length - payload_offset < size) {
+        g_warning("Truncated trace record at offset %" G_GSIZE_FORMAT, reader->offset);
+        return FALSE;
+    }
+
+    record->timestamp_us = GUINT64_FROM_LE(timestamp_le);
+    record->stream = GUINT32_FROM_LE(stream_le);
+    record->direction = header[12];
+    record->type = header[13];
+    record->payload = g_bytes_new_from_bytes(reader->contents, payload_offset, size);
+
+    reader->offset = payload_offset + size;
+
+    return TRUE;
+}
+
+void trace_reader_close(TraceReader *reader) {
+    if (!reader) return;
+
+    g_bytes_unref(reader->contents);
+    g_mapped_file_unref(reader->mapped_file);
+    g_free(reader);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary WebSocket session trace.
+ *
+ * File layout (all integers little-endian):
+ *   header: "WSTR" | u8 version | u8 role | u16 reserved | i64 wall clock start (us)
+ *   record: u64 timestamp (us, monotonic, relative to start) | u32 stream | u8 direction | u8 type | u32 size | payload
+ */
+
+#define TRACE_VERSION 1
+
+typedef enum {
+    TRACE_ROLE_CLIENT = 0,
+    TRACE_ROLE_SERVER = 1,
+} TraceRole;
+
+typedef enum {
+    TRACE_DIRECTION_IN = 0,
+    TRACE_DIRECTION_OUT = 1,
+} TraceDirection;
+
+// Same values as the WebSocket opcodes (and SoupWebsocketDataType)
+typedef enum {
+    TRACE_FRAME_TEXT = 1,
+    TRACE_FRAME_BINARY = 2,
+} TraceFrameType;
+
+typedef struct {
+    guint64 timestamp_us;
+    guint32 stream;
+    TraceDirection direction;
+    TraceFrameType type;
+    /// Slice of the mapped trace file, owned by the caller
+    GBytes *payload;
+} TraceRecord;
+
+typedef struct _TraceWriter TraceWriter;
+typedef struct _TraceReader TraceReader;
+
+/// Not thread-safe, records must be written from the owning main context. Records are written in batches, and
+/// trace_writer_close() writes the last one.
+TraceWriter *trace_writer_open(const char *path, TraceRole role, GError **error);
+
+/// Keeps a reference to the payload until the record is written, instead of copying it.
+void trace_writer_record_bytes(TraceWriter *writer,
+                               guint32 stream,
+                               TraceDirection direction,
+                               TraceFrameType type,
+                               GBytes *payload);
+
+/// Copies the payload, for data that doesn't live in a GBytes.
+void trace_writer_record(TraceWriter *writer,
+                         guint32 stream,
+                         TraceDirection direction,
+                         TraceFrameType type,
+                         gconstpointer data,
+                         gsize size);
+
+void trace_writer_close(TraceWriter *writer);
+
+TraceReader *trace_reader_open(const char *path, GError **error);
+
+TraceRole trace_reader_get_role(TraceReader *reader);
+
+/// Returns FALSE at the end of the trace or on a truncated record.
+gboolean trace_reader_next(TraceReader *reader, TraceRecord *record);
+
+void trace_reader_close(TraceReader *reader);
+
+#ifdef __cplusplus
+}
+#endif
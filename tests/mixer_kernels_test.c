@@ -0,0 +1,153 @@
+// The kernels are internal to the mixer
+#include "../src/server/mixer.c"
+
+/// Covers whole vectors, the scalar tail and buffers without a vector at all
+#define TEST_MAX_SAMPLES 67
+#define TEST_RANDOM_ROUNDS 2000
+
+static const gint16 edge_samples[] = {G_MININT16, G_MININT16 + 1, -32767, -1, 0, 1, 32766, G_MAXINT16};
+
+/// Gains as the mixer stores them, up to 16.0. Those above 16 bits take the scalar path in every build.
+static const gint32 edge_gains[] = {0,
+                                    1,
+                                    MIXER_GAIN_UNITY / 2,
+                                    MIXER_GAIN_UNITY,
+                                    3 * MIXER_GAIN_UNITY,
+                                    G_MAXINT16,
+                                    G_MAXINT16 + 1,
+                                    16 * MIXER_GAIN_UNITY};
+
+static void scalar_add_saturating_s16(gint16 *dst, const gint16 *src, gsize samples) {
+    for (gsize i = 0; i < samples; i++) {
+        gint32 sum = (gint32)dst[i] + src[i];
+        dst[i] = (gint16)CLAMP(sum, G_MININT16, G_MAXINT16);
+    }
+}
+
+static void scalar_apply_gain_s16(gint16 *dst, const gint16 *src, gsize samples, gint32 gain) {
+    for (gsize i = 0; i < samples; i++) {
+        gint64 scaled = ((gint64)src[i] * gain) >> MIXER_GAIN_SHIFT;
+        dst[i] = (gint16)CLAMP(scaled, G_MININT16, G_MAXINT16);
+    }
+}
+
+static gint16 random_sample(GRand *rand) {
+    // Mostly full range, often an edge value to hit saturation in every lane
+    if (g_rand_int_range(rand, 0, 4) == 0) {
+        return edge_samples[g_rand_int_range(rand, 0, G_N_ELEMENTS(edge_samples))];
+    }
+    return (gint16)g_rand_int_range(rand, G_MININT16, G_MAXINT16 + 1);
+}
+
+static void fill_random(GRand *rand, gint16 *samples, gsize count) {
+    for (gsize i = 0; i < count; i++) {
+        samples[i] = random_sample(rand);
+    }
+}
+
+/// Both kernels must match the scalar reference exactly, including the samples past the count, which stay untouched.
+static void check_add(const gint16 *dst, const gint16 *src, gsize samples, gsize offset) {
+    gint16 expected[TEST_MAX_SAMPLES + 2];
+    gint16 actual[TEST_MAX_SAMPLES + 2];
+    memcpy(expected, dst, sizeof(expected));
+    memcpy(actual, dst, sizeof(actual));
+
+    scalar_add_saturating_s16(expected + offset, src, samples);
+    pcm_add_saturating_s16(actual + offset, src, samples);
+
+    g_assert_cmpmem(actual, sizeof(actual), expected, sizeof(expected));
+}
+
+static void check_gain(const gint16 *src, gsize samples, gsize offset, gint32 gain) {
+    gint16 expected[TEST_MAX_SAMPLES + 2] = {0};
+    gint16 actual[TEST_MAX_SAMPLES + 2] = {0};
+
+    scalar_apply_gain_s16(expected + offset, src, samples, gain);
+    pcm_apply_gain_s16(actual + offset, src, samples, gain);
+
+    g_assert_cmpmem(actual, sizeof(actual), expected, sizeof(expected));
+}
+
+static void test_add_edges(void) {
+    gint16 dst[TEST_MAX_SAMPLES + 2];
+    gint16 src[TEST_MAX_SAMPLES];
+
+    // Every pair of edge values, in every lane position
+    for (gsize a = 0; a < G_N_ELEMENTS(edge_samples); a++) {
+        for (gsize b = 0; b < G_N_ELEMENTS(edge_samples); b++) {
+            for (gsize i = 0; i < TEST_MAX_SAMPLES; i++) {
+                src[i] = edge_samples[(b + i) % G_N_ELEMENTS(edge_samples)];
+            }
+            for (gsize i = 0; i < G_N_ELEMENTS(dst); i++) {
+                dst[i] = edge_samples[a];
+            }
+
+            for (gsize samples = 0; samples <= TEST_MAX_SAMPLES; samples++) {
+                check_add(dst, src, samples, 0);
+                check_add(dst, src, samples, 1);
+            }
+        }
+    }
+}
+
+static void test_add_random(void) {
+    GRand *rand = g_rand_new_with_seed(1);
+    gint16 dst[TEST_MAX_SAMPLES + 2];
+    gint16 src[TEST_MAX_SAMPLES];
+
+    for (gint round = 0; round < TEST_RANDOM_ROUNDS; round++) {
+        fill_random(rand, dst, G_N_ELEMENTS(dst));
+        fill_random(rand, src, G_N_ELEMENTS(src));
+
+        gsize samples = g_rand_int_range(rand, 0, TEST_MAX_SAMPLES + 1);
+        check_add(dst, src, samples, g_rand_int_range(rand, 0, 2));
+    }
+
+    g_rand_free(rand);
+}
+
+static void test_gain_edges(void) {
+    gint16 src[TEST_MAX_SAMPLES];
+
+    for (gsize g = 0; g < G_N_ELEMENTS(edge_gains); g++) {
+        for (gsize b = 0; b < G_N_ELEMENTS(edge_samples); b++) {
+            for (gsize i = 0; i < TEST_MAX_SAMPLES; i++) {
+                src[i] = edge_samples[(b + i) % G_N_ELEMENTS(edge_samples)];
+            }
+
+            for (gsize samples = 0; samples <= TEST_MAX_SAMPLES; samples++) {
+                check_gain(src, samples, 0, edge_gains[g]);
+                check_gain(src, samples, 1, edge_gains[g]);
+            }
+        }
+    }
+}
+
+static void test_gain_random(void) {
+    GRand *rand = g_rand_new_with_seed(2);
+    gint16 src[TEST_MAX_SAMPLES];
+
+    for (gint round = 0; round < TEST_RANDOM_ROUNDS; round++) {
+        fill_random(rand, src, G_N_ELEMENTS(src));
+
+        // Converted from a linear gain the way mixer_add_stream() does
+        gdouble linear = g_rand_double_range(rand, 0.0, 16.0);
+        gint32 gain = (gint32)(CLAMP(linear, 0.0, 16.0) * MIXER_GAIN_UNITY + 0.5);
+
+        gsize samples = g_rand_int_range(rand, 0, TEST_MAX_SAMPLES + 1);
+        check_gain(src, samples, g_rand_int_range(rand, 0, 2), gain);
+    }
+
+    g_rand_free(rand);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/mixer/kernels/add_saturating/edges", test_add_edges);
+    g_test_add_func("/mixer/kernels/add_saturating/random", test_add_random);
+    g_test_add_func("/mixer/kernels/apply_gain/edges", test_gain_edges);
+    g_test_add_func("/mixer/kernels/apply_gain/random", test_gain_random);
+
+    return g_test_run();
+}
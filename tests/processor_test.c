@@ -0,0 +1,356 @@
+// The tests check the queue depths the watermarks are defined on
+#include "../src/server/processor.c"
+
+#define TEST_STREAMS 20
+#define TEST_ORDERING_MESSAGES 500
+
+typedef struct {
+    Processor *processor;
+
+    /// Work functions block until the gate opens, or take one ticket each
+    GMutex mutex;
+    GCond cond;
+    gboolean gate_open;
+    guint tickets;
+    guint running;
+    /// Makes the work take a random few microseconds, so that streams overtake each other
+    gboolean jitter;
+
+    guint next_index[TEST_STREAMS];
+    guint done;
+    guint paused[TEST_STREAMS];
+    guint resumed[TEST_STREAMS];
+    /// Processor queue depths seen by the backpressure callback
+    guint first_pause_queued;
+    guint max_resume_queued;
+    guint max_resume_pending;
+} ProcessorFixture;
+
+static gpointer stream_id(guint stream) {
+    return GUINT_TO_POINTER(stream + 1);
+}
+
+static guint stream_index(gpointer id) {
+    return GPOINTER_TO_UINT(id) - 1;
+}
+
+static gpointer test_work(gpointer id, GBytes *data, gint64 timestamp_us, gpointer user_data) {
+    ProcessorFixture *fixture = user_data;
+
+    g_mutex_lock(&fixture->mutex);
+    fixture->running++;
+    g_cond_broadcast(&fixture->cond);
+    while (!fixture->gate_open && fixture->tickets == 0) {
+        g_cond_wait(&fixture->cond, &fixture->mutex);
+    }
+    if (!fixture->gate_open) {
+        fixture->tickets--;
+    }
+    fixture->running--;
+    g_mutex_unlock(&fixture->mutex);
+
+    if (fixture->jitter) {
+        g_usleep(g_random_int_range(0, 50));
+    }
+
+    // The message index, offset so that index 0 isn't NULL
+    guint index;
+    memcpy(&index, g_bytes_get_data(data, NULL), sizeof(index));
+    return GUINT_TO_POINTER(index + 1);
+}
+
+static void test_done(gpointer id, gpointer result, gpointer user_data) {
+    ProcessorFixture *fixture = user_data;
+    guint stream = stream_index(id);
+
+    g_assert_cmpuint(GPOINTER_TO_UINT(result), ==, fixture->next_index[stream] + 1);
+    fixture->next_index[stream]++;
+    fixture->done++;
+}
+
+static void test_backpressure(gpointer id, gboolean paused, gpointer user_data) {
+    ProcessorFixture *fixture = user_data;
+    Processor *processor = fixture->processor;
+    guint stream = stream_index(id);
+
+    g_mutex_lock(&processor->mutex);
+
+    if (paused) {
+        g_assert_cmpuint(fixture->paused[stream], ==, fixture->resumed[stream]);
+        fixture->paused[stream]++;
+
+        if (fixture->first_pause_queued == 0) {
+            fixture->first_pause_queued = processor->queued;
+        }
+    } else {
+        g_assert_cmpuint(fixture->resumed[stream] + 1, ==, fixture->paused[stream]);
+        fixture->resumed[stream]++;
+
+        ProcessorStream *processor_stream = g_hash_table_lookup(processor->streams, id);
+        fixture->max_resume_queued = MAX(fixture->max_resume_queued, processor->queued);
+        fixture->max_resume_pending =
+            MAX(fixture->max_resume_pending, g_queue_get_length(&processor_stream->pending));
+    }
+
+    g_mutex_unlock(&processor->mutex);
+}
+
+static void processor_fixture_set_up(ProcessorFixture *fixture, gconstpointer user_data) {
+    memset(fixture, 0, sizeof(*fixture));
+    g_mutex_init(&fixture->mutex);
+    g_cond_init(&fixture->cond);
+
+    ProcessorFuncs funcs = {
+        .work = test_work,
+        .done = test_done,
+        .backpressure = test_backpressure,
+    };
+    fixture->processor = processor_new(NULL, GPOINTER_TO_UINT(user_data), &funcs, fixture);
+}
+
+static void open_gate(ProcessorFixture *fixture) {
+    g_mutex_lock(&fixture->mutex);
+    fixture->gate_open = TRUE;
+    g_cond_broadcast(&fixture->cond);
+    g_mutex_unlock(&fixture->mutex);
+}
+
+/// Lets one message through and runs the main context until its result is delivered.
+static void step(ProcessorFixture *fixture) {
+    g_mutex_lock(&fixture->mutex);
+    fixture->tickets++;
+    g_cond_broadcast(&fixture->cond);
+    g_mutex_unlock(&fixture->mutex);
+
+    guint done = fixture->done + 1;
+    while (fixture->done < done) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+static void processor_fixture_tear_down(ProcessorFixture *fixture, gconstpointer user_data) {
+    open_gate(fixture);
+    processor_free(fixture->processor);
+
+    // Nothing may be left for the main context once the processor is gone
+    g_assert_false(g_main_context_pending(NULL));
+
+    g_cond_clear(&fixture->cond);
+    g_mutex_clear(&fixture->mutex);
+}
+
+static gboolean push(ProcessorFixture *fixture, guint stream, guint index) {
+    GBytes *data = g_bytes_new(&index, sizeof(index));
+    gboolean queued = processor_push(fixture->processor, stream_id(stream), data);
+    g_bytes_unref(data);
+    return queued;
+}
+
+static void wait_running(ProcessorFixture *fixture, guint running) {
+    g_mutex_lock(&fixture->mutex);
+    while (fixture->running != running) {
+        g_cond_wait(&fixture->cond, &fixture->mutex);
+    }
+    g_mutex_unlock(&fixture->mutex);
+}
+
+static void run_until_done(ProcessorFixture *fixture, guint done) {
+    while (fixture->done < done) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+/// Runs the main context until the processor has let go of every removed stream.
+static void run_until_retired(ProcessorFixture *fixture) {
+    Processor *processor = fixture->processor;
+
+    for (;;) {
+        g_mutex_lock(&processor->mutex);
+        guint retired = g_hash_table_size(processor->retired);
+        g_mutex_unlock(&processor->mutex);
+
+        if (retired == 0) break;
+
+        if (!g_main_context_iteration(NULL, FALSE)) {
+            g_usleep(100);
+        }
+    }
+}
+
+static void test_per_stream_ordering(ProcessorFixture *fixture, gconstpointer user_data) {
+    fixture->jitter = TRUE;
+    open_gate(fixture);
+
+    guint pushed = 0;
+
+    for (guint index = 0; index < TEST_ORDERING_MESSAGES; index++) {
+        for (guint stream = 0; stream < TEST_STREAMS; stream++) {
+            // A full queue drops the message, give the workers time rather than losing it
+            while (!push(fixture, stream, index)) {
+                g_main_context_iteration(NULL, TRUE);
+            }
+            pushed++;
+        }
+    }
+
+    run_until_done(fixture, pushed);
+
+    for (guint stream = 0; stream < TEST_STREAMS; stream++) {
+        g_assert_cmpuint(fixture->next_index[stream], ==, TEST_ORDERING_MESSAGES);
+        g_assert_cmpuint(fixture->paused[stream], ==, fixture->resumed[stream]);
+    }
+}
+
+static void test_stream_watermarks(ProcessorFixture *fixture, gconstpointer user_data) {
+    // The first message keeps the only worker busy, the rest stays queued
+    g_assert_true(push(fixture, 0, 0));
+    wait_running(fixture, 1);
+
+    guint index = 1;
+
+    for (; index < PROCESSOR_STREAM_QUEUE_HIGH; index++) {
+        g_assert_true(push(fixture, 0, index));
+        g_assert_cmpuint(fixture->paused[0], ==, 0);
+    }
+
+    // Pauses when its queue reaches the high watermark
+    g_assert_true(push(fixture, 0, index++));
+    g_assert_cmpuint(fixture->paused[0], ==, 1);
+
+    for (; index <= PROCESSOR_STREAM_QUEUE_MAX; index++) {
+        g_assert_true(push(fixture, 0, index));
+    }
+
+    // Dropped beyond the hard limit, without pausing again
+    g_assert_false(push(fixture, 0, index));
+    g_assert_cmpuint(fixture->paused[0], ==, 1);
+
+    // Resumes once, after draining to the low watermark
+    while (fixture->done < index) {
+        step(fixture);
+    }
+
+    g_assert_cmpuint(fixture->resumed[0], ==, 1);
+    g_assert_cmpuint(fixture->max_resume_pending, <=, PROCESSOR_STREAM_QUEUE_LOW);
+    g_assert_cmpuint(fixture->next_index[0], ==, index);
+}
+
+static void test_total_watermarks(ProcessorFixture *fixture, gconstpointer user_data) {
+    g_assert_true(push(fixture, 0, 0));
+    wait_running(fixture, 1);
+
+    // Every stream stays below its own high watermark, together they pass the total one
+    guint per_stream = PROCESSOR_STREAM_QUEUE_HIGH - 3;
+    g_assert_cmpuint(TEST_STREAMS * per_stream, >, PROCESSOR_TOTAL_QUEUE_HIGH);
+
+    guint pushed = 1;
+
+    for (guint index = 0; index < per_stream; index++) {
+        for (guint stream = 0; stream < TEST_STREAMS; stream++) {
+            if (stream == 0 && index == 0) continue;
+
+            g_assert_true(push(fixture, stream, index));
+            pushed++;
+        }
+    }
+
+    g_assert_cmpuint(fixture->first_pause_queued, ==, PROCESSOR_TOTAL_QUEUE_HIGH);
+
+    while (fixture->done < pushed) {
+        step(fixture);
+    }
+
+    guint paused_streams = 0;
+
+    for (guint stream = 0; stream < TEST_STREAMS; stream++) {
+        g_assert_cmpuint(fixture->paused[stream], ==, fixture->resumed[stream]);
+        g_assert_cmpuint(fixture->next_index[stream], ==, per_stream);
+        paused_streams += fixture->paused[stream];
+    }
+
+    // Everything pushed from the high watermark on paused its stream
+    g_assert_cmpuint(paused_streams, ==, pushed - PROCESSOR_TOTAL_QUEUE_HIGH);
+    g_assert_cmpuint(fixture->max_resume_queued, <=, PROCESSOR_TOTAL_QUEUE_LOW);
+    g_assert_cmpuint(fixture->max_resume_pending, <=, PROCESSOR_STREAM_QUEUE_LOW);
+}
+
+/// Waits until the stream's results wait for a dispatch on the main context, which hasn't run yet.
+static void wait_dispatch_pending(ProcessorFixture *fixture, guint stream) {
+    Processor *processor = fixture->processor;
+
+    for (;;) {
+        g_mutex_lock(&processor->mutex);
+        ProcessorStream *processor_stream = g_hash_table_lookup(processor->streams, stream_id(stream));
+        gboolean pending = processor_stream->dispatch_scheduled && !processor_stream->scheduled;
+        g_mutex_unlock(&processor->mutex);
+
+        if (pending) break;
+
+        g_usleep(100);
+    }
+}
+
+static void test_remove_with_dispatch_pending(ProcessorFixture *fixture, gconstpointer user_data) {
+    open_gate(fixture);
+
+    g_assert_true(push(fixture, 0, 0));
+    g_assert_true(push(fixture, 1, 0));
+    wait_dispatch_pending(fixture, 0);
+
+    processor_remove_stream(fixture->processor, stream_id(0));
+
+    // The dispatch releases the stream without delivering its results, other streams are unaffected
+    run_until_done(fixture, 1);
+    run_until_retired(fixture);
+
+    g_assert_cmpuint(fixture->next_index[0], ==, 0);
+    g_assert_cmpuint(fixture->next_index[1], ==, 1);
+
+    // The id can be used for a new stream
+    g_assert_true(push(fixture, 0, 0));
+    run_until_done(fixture, 2);
+    g_assert_cmpuint(fixture->next_index[0], ==, 1);
+}
+
+static void test_free_with_dispatch_pending(ProcessorFixture *fixture, gconstpointer user_data) {
+    open_gate(fixture);
+
+    g_assert_true(push(fixture, 0, 0));
+    wait_dispatch_pending(fixture, 0);
+
+    processor_remove_stream(fixture->processor, stream_id(0));
+
+    // Tear down frees the processor with the dispatch still attached, it must be destroyed rather than run
+}
+
+static void test_remove_while_running(ProcessorFixture *fixture, gconstpointer user_data) {
+    g_assert_true(push(fixture, 0, 0));
+    g_assert_true(push(fixture, 0, 1));
+    wait_running(fixture, 1);
+
+    processor_remove_stream(fixture->processor, stream_id(0));
+    open_gate(fixture);
+
+    run_until_retired(fixture);
+
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+    g_assert_cmpuint(fixture->done, ==, 0);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+#define ADD_PROCESSOR_TEST(path, threads, func) \
+    g_test_add(                                 \
+        path, ProcessorFixture, GUINT_TO_POINTER(threads), processor_fixture_set_up, func, processor_fixture_tear_down)
+
+    ADD_PROCESSOR_TEST("/processor/per_stream_ordering", 4, test_per_stream_ordering);
+    ADD_PROCESSOR_TEST("/processor/backpressure/stream_watermarks", 1, test_stream_watermarks);
+    ADD_PROCESSOR_TEST("/processor/backpressure/total_watermarks", 1, test_total_watermarks);
+    ADD_PROCESSOR_TEST("/processor/remove/dispatch_pending", 1, test_remove_with_dispatch_pending);
+    ADD_PROCESSOR_TEST("/processor/remove/free_with_dispatch_pending", 1, test_free_with_dispatch_pending);
+    ADD_PROCESSOR_TEST("/processor/remove/while_running", 1, test_remove_while_running);
+
+    return g_test_run();
+}
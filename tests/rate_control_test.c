@@ -0,0 +1,106 @@
+#include "../src/client/rate_control.h"
+
+#define TEST_SAMPLE_RATE 48000
+#define TEST_FRAME_SIZE 4
+#define TEST_DURATION_MS 10000
+
+/// Runs the client's send loop in virtual time with the chunk pinned at size chunk_ms: a tick every chunk sends what
+/// is due as far as the in-flight limit allows, a probe goes out every PROBE_INTERVAL_MS and is answered rtt_ms later.
+/// Returns the largest backlog of audio that was due but not sent, once the first probe was answered.
+static gsize simulate_steady_state(guint chunk_ms, gint64 rtt_ms) {
+    RateControl rate;
+    rate_control_reset(&rate, TEST_SAMPLE_RATE, TEST_FRAME_SIZE, 0);
+    rate.chunk_ms = chunk_ms;
+    rate_control_update_inflight_limit(&rate);
+
+    gsize chunk_size = rate_control_ms_to_bytes(&rate, chunk_ms);
+    gsize sent_bytes = 0;
+    gsize acked_bytes = 0;
+
+    // The RTT is below the probe interval, so at most one probe is unanswered
+    gint64 probe_time_ms = -1;
+    gsize probe_sent_bytes = 0;
+
+    gsize max_backlog = 0;
+
+    for (gint64 now_ms = 0; now_ms <= TEST_DURATION_MS; now_ms++) {
+        if (probe_time_ms >= 0 && now_ms == probe_time_ms + rtt_ms) {
+            acked_bytes = MAX(acked_bytes, probe_sent_bytes);
+            rate_control_update_rtt(&rate, rtt_ms * 1000, now_ms * 1000);
+            probe_time_ms = -1;
+        }
+
+        if (now_ms > 0 && now_ms % PROBE_INTERVAL_MS == 0) {
+            probe_time_ms = now_ms;
+            probe_sent_bytes = sent_bytes;
+        }
+
+        if (now_ms % chunk_ms != 0) continue;
+
+        gsize due = rate_control_ms_to_bytes(&rate, now_ms);
+
+        while (sent_bytes + chunk_size <= due &&
+               rate_control_may_send(&rate, sent_bytes - acked_bytes, chunk_size)) {
+            sent_bytes += chunk_size;
+        }
+
+        if (rate.srtt_us > 0) {
+            max_backlog = MAX(max_backlog, due - sent_bytes);
+        }
+    }
+
+    g_assert_cmpint(rate.srtt_us, ==, rtt_ms * 1000);
+    return max_backlog;
+}
+
+static void test_steady_state_min_chunk(void) {
+    // Acknowledgements only come every probe interval, the minimum chunk must still keep up with real time
+    for (gint64 rtt_ms = 1; rtt_ms <= 100; rtt_ms *= 10) {
+        gsize backlog = simulate_steady_state(CHUNK_MS_MIN, rtt_ms);
+        g_assert_cmpuint(backlog, ==, 0);
+    }
+}
+
+static void test_steady_state_max_chunk(void) {
+    gsize backlog = simulate_steady_state(CHUNK_MS_MAX, 1);
+    g_assert_cmpuint(backlog, ==, 0);
+}
+
+static void test_unprobed_not_held_back(void) {
+    RateControl rate;
+    rate_control_reset(&rate, TEST_SAMPLE_RATE, TEST_FRAME_SIZE, 0);
+
+    // A server that doesn't answer probes never acknowledges anything
+    g_assert_true(rate_control_may_send(&rate, 10 * rate.inflight_limit, rate.inflight_limit));
+}
+
+static void test_latency_rising_halves_chunk(void) {
+    RateControl rate;
+    rate_control_reset(&rate, TEST_SAMPLE_RATE, TEST_FRAME_SIZE, 0);
+
+    gint64 now_us = G_USEC_PER_SEC;
+    rate_control_update_rtt(&rate, 1000, now_us);
+    g_assert_cmpuint(rate_control_adapt(&rate, FALSE, 0, now_us), ==, CHUNK_MS_INITIAL);
+    g_assert_cmpuint(rate.chunk_ms, ==, CHUNK_MS_INITIAL + CHUNK_MS_STEP);
+
+    // Queueing on the way, the smoothed RTT climbs well above the baseline
+    while (rate.chunk_ms > CHUNK_MS_MIN) {
+        now_us += PROBE_INTERVAL_MS * 1000;
+        rate_control_update_rtt(&rate, 100000, now_us);
+        rate_control_adapt(&rate, FALSE, 0, now_us);
+    }
+
+    g_assert_cmpuint(rate.chunk_ms, ==, CHUNK_MS_MIN);
+    g_assert_cmpuint(rate.inflight_limit, >=, rate_control_ms_to_bytes(&rate, PROBE_INTERVAL_MS));
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/rate_control/steady_state/min_chunk", test_steady_state_min_chunk);
+    g_test_add_func("/rate_control/steady_state/max_chunk", test_steady_state_max_chunk);
+    g_test_add_func("/rate_control/unprobed_not_held_back", test_unprobed_not_held_back);
+    g_test_add_func("/rate_control/latency_rising_halves_chunk", test_latency_rising_halves_chunk);
+
+    return g_test_run();
+}
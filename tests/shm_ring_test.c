@@ -0,0 +1,335 @@
+// The tests need the ring internals to corrupt it the way a misbehaving producer would
+#include "../src/utils/shm_ring.c"
+
+#define TEST_CAPACITY 4096
+
+typedef struct {
+    ShmRing *producer;
+    ShmRing *consumer;
+    GString *received;
+    /// Messages with a higher sequence are left in the ring
+    guint32 max_sequence;
+} RingFixture;
+
+static void ring_fixture_set_up(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    fixture->producer = shm_ring_new(TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+
+    // A second mapping of the same memfd, as the server would have
+    fixture->consumer =
+        shm_ring_map(dup(fixture->producer->memfd), dup(fixture->producer->eventfd), TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+
+    fixture->received = g_string_new(NULL);
+    fixture->max_sequence = G_MAXUINT32;
+}
+
+static void ring_fixture_tear_down(RingFixture *fixture, gconstpointer user_data) {
+    shm_ring_free(fixture->consumer);
+    shm_ring_free(fixture->producer);
+    g_string_free(fixture->received, TRUE);
+}
+
+static gboolean append_message(guint32 sequence, gconstpointer data, gsize size, gpointer user_data) {
+    RingFixture *fixture = user_data;
+
+    if (sequence > fixture->max_sequence) {
+        return FALSE;
+    }
+
+    g_string_append_len(fixture->received, data, size);
+    g_string_append_c(fixture->received, ';');
+    return TRUE;
+}
+
+static gboolean consume(RingFixture *fixture, GError **error) {
+    return shm_ring_consume(fixture->consumer, append_message, fixture, error);
+}
+
+static void test_round_trip(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    g_assert_true(shm_ring_write(fixture->producer, 0, "abc", 3));
+    g_assert_true(shm_ring_write(fixture->producer, 0, "defgh", 5));
+
+    g_assert_true(consume(fixture, &error));
+    g_assert_no_error(error);
+    g_assert_cmpstr(fixture->received->str, ==, "abc;defgh;");
+}
+
+static void test_wrap_around(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+    gsize size = shm_ring_get_max_message_size(fixture->producer) - 100;
+    gchar *message = g_malloc0(size);
+
+    // The third message doesn't fit before the end and continues at the start
+    for (guint i = 0; i < 3; i++) {
+        g_assert_true(shm_ring_write(fixture->producer, 0, message, size));
+        g_assert_true(consume(fixture, &error));
+        g_assert_no_error(error);
+    }
+
+    g_assert_cmpuint(fixture->received->len, ==, 3 * (size + 1));
+    g_free(message);
+}
+
+static void test_held_back(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    g_assert_true(shm_ring_write(fixture->producer, 0, "abc", 3));
+    g_assert_true(shm_ring_write(fixture->producer, 1, "def", 3));
+    g_assert_true(shm_ring_write(fixture->producer, 1, "ghi", 3));
+
+    fixture->max_sequence = 0;
+    g_assert_true(consume(fixture, &error));
+    g_assert_cmpstr(fixture->received->str, ==, "abc;");
+
+    // Nothing new was written, the held back messages are still there
+    fixture->max_sequence = 1;
+    g_assert_true(consume(fixture, &error));
+    g_assert_no_error(error);
+    g_assert_cmpstr(fixture->received->str, ==, "abc;def;ghi;");
+}
+
+static void test_record_past_head(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    g_assert_true(shm_ring_write(fixture->producer, 0, "abcdefgh", 8));
+
+    guint32 length = 100;
+    memcpy(fixture->producer->data, &length, sizeof(length));
+
+    g_assert_false(consume(fixture, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+    g_assert_cmpstr(fixture->received->str, ==, "");
+}
+
+static void test_record_past_end(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    // A record claiming to run over the end of the ring, with the head far enough ahead to cover it
+    guint32 length = TEST_CAPACITY - 64;
+    memcpy(fixture->producer->data + 128, &length, sizeof(length));
+    fixture->consumer->tail = 128;
+    fixture->producer->header->tail = 128;
+    fixture->producer->header->head = 128 + TEST_CAPACITY;
+
+    g_assert_false(consume(fixture, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+}
+
+static void test_wrap_marker_past_head(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    guint32 wrap = SHM_RING_WRAP;
+    memcpy(fixture->producer->data, &wrap, sizeof(wrap));
+    fixture->producer->header->head = SHM_RECORD_HEADER_SIZE;
+
+    g_assert_false(consume(fixture, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+}
+
+static void test_head_beyond_capacity(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    fixture->producer->header->head = TEST_CAPACITY + SHM_RECORD_HEADER_SIZE;
+
+    g_assert_false(consume(fixture, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+}
+
+static void test_shared_tail_ignored(RingFixture *fixture, gconstpointer user_data) {
+    GError *error = NULL;
+
+    g_assert_true(shm_ring_write(fixture->producer, 0, "abc", 3));
+    g_assert_true(consume(fixture, &error));
+
+    // Rewinding the published tail must not make the consumer read the first message again
+    fixture->producer->header->tail = 0;
+
+    g_assert_true(shm_ring_write(fixture->producer, 0, "def", 3));
+    g_assert_true(consume(fixture, &error));
+    g_assert_no_error(error);
+    g_assert_cmpstr(fixture->received->str, ==, "abc;def;");
+}
+
+static ShmRing *receive_ring(ShmRing *ring, GError **error) {
+    int fds[2];
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds), ==, 0);
+
+    g_assert_true(shm_ring_send_handshake(fds[0], ring, "token", error));
+
+    gchar *token = NULL;
+    ShmRing *received = shm_listener_receive(fds[1], &token, error);
+    g_free(token);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return received;
+}
+
+static void test_sealed_ring_accepted(void) {
+    GError *error = NULL;
+
+    ShmRing *ring = shm_ring_new(TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+
+    ShmRing *received = receive_ring(ring, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(received);
+
+    shm_ring_free(received);
+    shm_ring_free(ring);
+}
+
+static void test_unsealed_ring_rejected(void) {
+    GError *error = NULL;
+
+    int memfd = memfd_create("shm_ring_test", MFD_CLOEXEC);
+    g_assert_cmpint(memfd, >=, 0);
+    g_assert_cmpint(ftruncate(memfd, sizeof(ShmRingHeader) + TEST_CAPACITY), ==, 0);
+
+    ShmRing *ring = shm_ring_map(memfd, eventfd(0, EFD_CLOEXEC), TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+    ring->header->magic = SHM_RING_MAGIC;
+    ring->header->capacity = TEST_CAPACITY;
+
+    g_assert_null(receive_ring(ring, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+
+    shm_ring_free(ring);
+}
+
+static void test_pipe_signal_rejected(void) {
+    GError *error = NULL;
+
+    ShmRing *ring = shm_ring_new(TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+
+    // A second read of a pipe would block the server
+    int pipe_fds[2];
+    g_assert_cmpint(pipe(pipe_fds), ==, 0);
+    close(ring->eventfd);
+    ring->eventfd = pipe_fds[0];
+
+    g_assert_null(receive_ring(ring, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+
+    close(pipe_fds[1]);
+    shm_ring_free(ring);
+}
+
+static void test_blocking_eventfd_made_nonblocking(void) {
+    GError *error = NULL;
+
+    ShmRing *ring = shm_ring_new(TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+
+    close(ring->eventfd);
+    ring->eventfd = eventfd(0, EFD_CLOEXEC);
+
+    ShmRing *received = receive_ring(ring, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(received);
+
+    // Returns right away with nothing signalled
+    g_assert_true(shm_ring_consume(received, append_message, NULL, &error));
+    g_assert_no_error(error);
+
+    shm_ring_free(received);
+    shm_ring_free(ring);
+}
+
+static guint count_open_fds(void) {
+    GDir *dir = g_dir_open("/proc/self/fd", 0, NULL);
+    g_assert_nonnull(dir);
+
+    guint count = 0;
+    while (g_dir_read_name(dir)) {
+        count++;
+    }
+    g_dir_close(dir);
+
+    return count;
+}
+
+static void test_wrong_fd_count_closed(void) {
+    GError *error = NULL;
+
+    ShmRing *ring = shm_ring_new(TEST_CAPACITY, &error);
+    g_assert_no_error(error);
+
+    int sockets[2];
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets), ==, 0);
+
+    guint open_before = count_open_fds();
+
+    // Only the memfd, without the eventfd
+    ShmHandshake handshake = {.magic = SHM_HANDSHAKE_MAGIC, .token = "token"};
+    struct iovec iov = {.iov_base = &handshake, .iov_len = sizeof(handshake)};
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ring->memfd, sizeof(int));
+
+    g_assert_cmpint(sendmsg(sockets[0], &message, 0), ==, sizeof(handshake));
+
+    gchar *token = NULL;
+    g_assert_null(shm_listener_receive(sockets[1], &token, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+    g_clear_error(&error);
+
+    g_assert_cmpuint(count_open_fds(), ==, open_before);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    shm_ring_free(ring);
+}
+
+int main(int argc, char *argv[]) {
+    g_test_init(&argc, &argv, NULL);
+
+#define ADD_RING_TEST(path, func) \
+    g_test_add(path, RingFixture, NULL, ring_fixture_set_up, func, ring_fixture_tear_down)
+
+    ADD_RING_TEST("/shm_ring/round_trip", test_round_trip);
+    ADD_RING_TEST("/shm_ring/wrap_around", test_wrap_around);
+    ADD_RING_TEST("/shm_ring/held_back", test_held_back);
+    ADD_RING_TEST("/shm_ring/corrupt/record_past_head", test_record_past_head);
+    ADD_RING_TEST("/shm_ring/corrupt/record_past_end", test_record_past_end);
+    ADD_RING_TEST("/shm_ring/corrupt/wrap_marker_past_head", test_wrap_marker_past_head);
+    ADD_RING_TEST("/shm_ring/corrupt/head_beyond_capacity", test_head_beyond_capacity);
+    ADD_RING_TEST("/shm_ring/corrupt/shared_tail_ignored", test_shared_tail_ignored);
+
+    g_test_add_func("/shm_ring/handshake/sealed", test_sealed_ring_accepted);
+    g_test_add_func("/shm_ring/handshake/unsealed", test_unsealed_ring_rejected);
+    g_test_add_func("/shm_ring/handshake/pipe_signal", test_pipe_signal_rejected);
+    g_test_add_func("/shm_ring/handshake/blocking_eventfd", test_blocking_eventfd_made_nonblocking);
+    g_test_add_func("/shm_ring/handshake/wrong_fd_count", test_wrong_fd_count_closed);
+
+    return g_test_run();
+}